@@ -0,0 +1,63 @@
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+
+#include "addr_set.hpp"
+#include "memory.hpp"
+
+template <typename T>
+class AddrMap {
+  public:
+    AddrMap() {}
+    AddrMap(const AddrMap &) = delete;
+    AddrMap &operator=(const AddrMap &) = delete;
+
+    T &operator[](addr address) {
+      std::unique_ptr<T[]> &page = pages[address >> PAGE_BITS];
+      if (!page) {
+        page.reset(new T[PAGE_SIZE]());
+      }
+      keySet.insert(address);
+      return page[address & PAGE_MASK];
+    }
+
+    T *find(addr address) {
+      if (!keySet.count(address)) {
+        return NULL;
+      }
+      return &pages[address >> PAGE_BITS][address & PAGE_MASK];
+    }
+
+    const T *find(addr address) const {
+      if (!keySet.count(address)) {
+        return NULL;
+      }
+      return &pages[address >> PAGE_BITS][address & PAGE_MASK];
+    }
+
+    const T &at(addr address) const {
+      const T *result = find(address);
+      if (!result) {
+        throw std::out_of_range("AddrMap::at");
+      }
+      return *result;
+    }
+
+    bool count(addr address) const {
+      return keySet.count(address);
+    }
+
+    const AddrSet &keys() const {
+      return keySet;
+    }
+
+  private:
+    static const unsigned PAGE_BITS = 8;
+    static const unsigned PAGE_SIZE = 1 << PAGE_BITS;
+    static const unsigned PAGE_MASK = PAGE_SIZE - 1;
+    static const unsigned PAGE_COUNT = (ADDR_MAX + 1) >> PAGE_BITS;
+
+    AddrSet keySet;
+    std::unique_ptr<T[]> pages[PAGE_COUNT];
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+
+#include "memory.hpp"
+
+class AddrSet {
+  public:
+    class const_iterator {
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef addr value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const addr *pointer;
+        typedef addr reference;
+
+        const_iterator(const AddrSet *set, uint32_t position) :
+          set(set),
+          position(position)
+        {}
+
+        addr operator*() const {
+          return position;
+        }
+
+        const_iterator &operator++() {
+          position = set->findNext(position + 1);
+          return *this;
+        }
+
+        bool operator==(const const_iterator &other) const {
+          return position == other.position;
+        }
+
+        bool operator!=(const const_iterator &other) const {
+          return position != other.position;
+        }
+
+      private:
+        const AddrSet *set;
+        uint32_t position;
+    };
+
+    AddrSet() {
+      clear();
+    }
+
+    bool insert(addr address) {
+      uint64_t mask = bitMask(address);
+      uint64_t &word = bits[wordIndex(address)];
+      if (word & mask) {
+        return false;
+      }
+      word |= mask;
+      summary[summaryIndex(address)] |= summaryMask(address);
+      return true;
+    }
+
+    bool erase(addr address) {
+      uint64_t mask = bitMask(address);
+      uint64_t &word = bits[wordIndex(address)];
+      if (!(word & mask)) {
+        return false;
+      }
+      word &= ~mask;
+      if (!word) {
+        summary[summaryIndex(address)] &= ~summaryMask(address);
+      }
+      return true;
+    }
+
+    bool count(addr address) const {
+      return bits[wordIndex(address)] & bitMask(address);
+    }
+
+    bool empty() const {
+      for (unsigned i = 0; i < SUMMARY_WORDS; i++) {
+        if (summary[i]) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    unsigned size() const {
+      unsigned result = 0;
+      for (unsigned i = 0; i < WORDS; i++) {
+        result += __builtin_popcountll(bits[i]);
+      }
+      return result;
+    }
+
+    void clear() {
+      memset(bits, 0, sizeof(bits));
+      memset(summary, 0, sizeof(summary));
+    }
+
+    void insert(const AddrSet &other) {
+      for (unsigned i = 0; i < WORDS; i++) {
+        bits[i] |= other.bits[i];
+      }
+      for (unsigned i = 0; i < SUMMARY_WORDS; i++) {
+        summary[i] |= other.summary[i];
+      }
+    }
+
+    addr last() const {
+      for (unsigned i = SUMMARY_WORDS; i-- > 0;) {
+        if (summary[i]) {
+          unsigned wordIdx = i * 64 + 63 - __builtin_clzll(summary[i]);
+          return wordIdx * 64 + 63 - __builtin_clzll(bits[wordIdx]);
+        }
+      }
+      return 0;
+    }
+
+    const_iterator begin() const {
+      return const_iterator(this, findNext(0));
+    }
+
+    const_iterator end() const {
+      return const_iterator(this, END);
+    }
+
+  private:
+    static const uint32_t END = ADDR_MAX + 1;
+    static const unsigned WORDS = END / 64;
+    static const unsigned SUMMARY_WORDS = WORDS / 64;
+
+    static unsigned wordIndex(addr address) {
+      return address >> 6;
+    }
+
+    static uint64_t bitMask(addr address) {
+      return (uint64_t)1 << (address & 63);
+    }
+
+    static unsigned summaryIndex(addr address) {
+      return address >> 12;
+    }
+
+    static uint64_t summaryMask(addr address) {
+      return (uint64_t)1 << ((address >> 6) & 63);
+    }
+
+    uint32_t findNext(uint32_t position) const {
+      if (position >= END) {
+        return END;
+      }
+
+      unsigned wordIdx = position >> 6;
+      uint64_t word = bits[wordIdx] & (~(uint64_t)0 << (position & 63));
+      if (word) {
+        return wordIdx * 64 + __builtin_ctzll(word);
+      }
+
+      wordIdx++;
+      unsigned summaryIdx = wordIdx >> 6;
+      if (summaryIdx >= SUMMARY_WORDS) {
+        return END;
+      }
+
+      uint64_t pending = summary[summaryIdx] & (~(uint64_t)0 << (wordIdx & 63));
+      while (!pending) {
+        if (++summaryIdx >= SUMMARY_WORDS) {
+          return END;
+        }
+        pending = summary[summaryIdx];
+      }
+
+      wordIdx = summaryIdx * 64 + __builtin_ctzll(pending);
+      return wordIdx * 64 + __builtin_ctzll(bits[wordIdx]);
+    }
+
+    uint64_t bits[WORDS];
+    uint64_t summary[SUMMARY_WORDS];
+};
@@ -0,0 +1,207 @@
+#include "backend.hpp"
+
+#include <cstring>
+
+#include <memory>
+using std::unique_ptr;
+
+#include <string>
+using std::string;
+
+#include <iostream>
+
+#include "llvm/Analysis/Passes.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Target/TargetSubtargetInfo.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Scalar.h"
+using llvm::DataLayoutPass;
+using llvm::Function;
+using llvm::FunctionPassManager;
+using llvm::Module;
+using llvm::PassManager;
+using llvm::PassManagerBuilder;
+using llvm::Target;
+using llvm::TargetMachine;
+using llvm::TargetOptions;
+using llvm::TargetRegistry;
+using llvm::formatted_raw_ostream;
+using llvm::raw_fd_ostream;
+
+bool parseOptLevel(const char *name, OptLevel &level) {
+  if (!strcmp(name, "0")) {
+    level = OPT_O0;
+  } else if (!strcmp(name, "1")) {
+    level = OPT_O1;
+  } else if (!strcmp(name, "2")) {
+    level = OPT_O2;
+  } else if (!strcmp(name, "3")) {
+    level = OPT_O3;
+  } else if (!strcmp(name, "t")) {
+    level = OPT_TUNED;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void initializeBackend() {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+}
+
+TargetMachine *createHostTargetMachine() {
+  string triple = llvm::sys::getDefaultTargetTriple();
+  string error;
+  const Target *target = TargetRegistry::lookupTarget(triple, error);
+  if (!target) {
+    std::cerr << "Could not find target " << triple << ": " << error << std::endl;
+    return NULL;
+  }
+
+  return target->createTargetMachine(triple, llvm::sys::getHostCPUName(), "", TargetOptions(), llvm::Reloc::PIC_, llvm::CodeModel::Default, llvm::CodeGenOpt::Aggressive);
+}
+
+void prepareModule(Module &module) {
+  unique_ptr<TargetMachine> machine(createHostTargetMachine());
+  if (!machine) {
+    return;
+  }
+
+  module.setTargetTriple(machine->getTargetTriple());
+  module.setDataLayout(machine->getSubtargetImpl()->getDataLayout());
+}
+
+unsigned getBuilderLevel(OptLevel level) {
+  switch (level) {
+    case OPT_O1:
+      return 1;
+    case OPT_O2:
+      return 2;
+    default:
+      return 3;
+  }
+}
+
+void addCleanupPasses(FunctionPassManager &passes) {
+  passes.add(llvm::createInstructionCombiningPass());
+  passes.add(llvm::createGVNPass());
+  passes.add(llvm::createCFGSimplificationPass());
+  passes.add(llvm::createAggressiveDCEPass());
+}
+
+void optimizeFunctions(Module &module, OptLevel level) {
+  if (level == OPT_O0) {
+    return;
+  }
+
+  FunctionPassManager passes(&module);
+  passes.add(new DataLayoutPass());
+
+  if (level == OPT_TUNED) {
+    // Promoted zero-page words live in allocas in the entry block, which
+    // mem2reg turns into SSA values; registers already are.
+    passes.add(llvm::createPromoteMemoryToRegisterPass());
+    passes.add(llvm::createEarlyCSEPass());
+    addCleanupPasses(passes);
+  } else {
+    PassManagerBuilder builder;
+    builder.OptLevel = getBuilderLevel(level);
+    builder.populateFunctionPassManager(passes);
+  }
+
+  passes.doInitialization();
+  for (Function &func : module) {
+    passes.run(func);
+  }
+  passes.doFinalization();
+}
+
+void optimizeModule(Module &module, OptLevel level) {
+  if (level == OPT_O0) {
+    return;
+  }
+
+  PassManager passes;
+  passes.add(new DataLayoutPass());
+
+  if (level == OPT_TUNED) {
+    // Drop unused register arguments and return fields before inlining.
+    passes.add(llvm::createIPSCCPPass());
+    passes.add(llvm::createDeadArgEliminationPass());
+    passes.add(llvm::createGlobalDCEPass());
+    passes.add(llvm::createFunctionInliningPass(2, 0));
+    passes.add(llvm::createInstructionCombiningPass());
+    passes.add(llvm::createGVNPass());
+    passes.add(llvm::createCFGSimplificationPass());
+    passes.add(llvm::createAggressiveDCEPass());
+  } else {
+    PassManagerBuilder builder;
+    builder.OptLevel = getBuilderLevel(level);
+    if (builder.OptLevel > 1) {
+      builder.Inliner = llvm::createFunctionInliningPass(builder.OptLevel, 0);
+    }
+    builder.populateModulePassManager(passes);
+  }
+
+  passes.run(module);
+}
+
+bool hasSuffix(const string &path, const char *suffix) {
+  size_t length = strlen(suffix);
+  return path.size() >= length && !path.compare(path.size() - length, length, suffix);
+}
+
+bool writeModule(Module &module, const string &path) {
+  if (path.empty()) {
+    module.dump();
+    return true;
+  }
+
+  std::error_code error;
+  raw_fd_ostream out(path, error, llvm::sys::fs::F_None);
+  if (error) {
+    std::cerr << "Could not open " << path << ": " << error.message() << std::endl;
+    return false;
+  }
+
+  if (hasSuffix(path, ".bc")) {
+    llvm::WriteBitcodeToFile(&module, out);
+    return true;
+  }
+
+  if (hasSuffix(path, ".ll")) {
+    module.print(out, NULL);
+    return true;
+  }
+
+  unique_ptr<TargetMachine> machine(createHostTargetMachine());
+  if (!machine) {
+    return false;
+  }
+
+  PassManager passes;
+  passes.add(new DataLayoutPass());
+
+  formatted_raw_ostream formatted(out);
+  if (machine->addPassesToEmitFile(passes, formatted, TargetMachine::CGFT_ObjectFile)) {
+    std::cerr << "Target does not support object file emission" << std::endl;
+    return false;
+  }
+
+  passes.run(module);
+  return true;
+}
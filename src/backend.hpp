@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+#include "llvm/IR/Module.h"
+
+enum OptLevel {
+  OPT_O0,
+  OPT_O1,
+  OPT_O2,
+  OPT_O3,
+  OPT_TUNED
+};
+
+bool parseOptLevel(const char *name, OptLevel &level);
+void initializeBackend();
+void prepareModule(llvm::Module &module);
+void optimizeFunctions(llvm::Module &module, OptLevel level);
+void optimizeModule(llvm::Module &module, OptLevel level);
+bool writeModule(llvm::Module &module, const std::string &path);
@@ -0,0 +1,287 @@
+#include "batch.hpp"
+
+#include <ucontext.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+
+#include <mutex>
+using std::lock_guard;
+using std::mutex;
+
+#include <thread>
+using std::thread;
+
+#include <vector>
+using std::vector;
+
+#include "nes_machine_spec.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+const size_t FIBER_STACK_SIZE = 1 << 20;
+const size_t FIBER_STACK_SLACK = 0x400;
+
+struct BatchInstance {
+  unsigned index;
+  std::unique_ptr<NesRuntime> runtime;
+  RegisterState regs;
+  InputScript script;
+  EntryPoint reset;
+
+  ucontext_t context;
+  ucontext_t *scheduler;
+  std::unique_ptr<word[]> stack;
+  size_t stackLow;
+  bool started;
+  bool finished;
+
+  uint64_t frames;
+  uint64_t sliceEnd;
+
+  std::unique_ptr<StateHistory> history;
+};
+
+struct BatchQueue {
+  mutex lock;
+  std::deque<BatchInstance *> instances;
+};
+
+// makecontext can only pass ints portably, so a new fiber picks up its
+// instance from the thread that starts it.
+thread_local BatchInstance *startingInstance = NULL;
+
+// Remembers how deep the fiber's stack is while suspended, with some slack
+// for the frames swapcontext itself pushes, so snapshots can skip the rest.
+void yieldInstance(BatchInstance &instance) {
+  word marker;
+  size_t depth = &marker - instance.stack.get();
+  instance.stackLow = depth > FIBER_STACK_SLACK ? depth - FIBER_STACK_SLACK : 0;
+  swapcontext(&instance.context, instance.scheduler);
+}
+
+void runInstance() {
+  BatchInstance &instance = *startingInstance;
+  instance.runtime->enter(instance.reset, instance.regs);
+  instance.finished = true;
+  yieldInstance(instance);
+}
+
+word getScriptedButtons(const InputScript &script, uint64_t frame) {
+  if (script.empty()) {
+    return 0;
+  }
+  return script[std::min<uint64_t>(frame, script.size() - 1)];
+}
+
+BatchExecutor::BatchExecutor(const NesMachineSpec &machine, EntryPoint reset, NativeResolver resolver, const BatchOptions &options) :
+  options(options),
+  reset(reset)
+{
+  for (unsigned i = 0; i < options.instances; i++) {
+    BatchInstance *instance = new BatchInstance();
+    instance->index = i;
+    instance->runtime.reset(new NesRuntime(machine));
+    instance->regs = {0, 0, 0, 0, 0, 0, 0};
+    instance->reset = reset;
+    instance->scheduler = NULL;
+    instance->started = false;
+    instance->finished = false;
+    instance->frames = 0;
+    instance->sliceEnd = 0;
+    instance->stackLow = FIBER_STACK_SIZE;
+    if (options.historySize) {
+      instance->history.reset(new StateHistory(options.historySize));
+    }
+    instances.push_back(std::unique_ptr<BatchInstance>(instance));
+
+    // The JIT is shared and not thread-safe, so instances never promote
+    // new code; they only run what was compiled up front.
+    instance->runtime->getInterpreter().setNativeTier(resolver, NativePromoter());
+    instance->runtime->setFrameHandler([instance]() {
+      instance->frames++;
+      instance->runtime->setButtons(getScriptedButtons(instance->script, instance->frames));
+      if (instance->frames >= instance->sliceEnd) {
+        yieldInstance(*instance);
+      }
+    });
+  }
+
+  for (unsigned i = 0; i < std::max(options.workers, 1u); i++) {
+    queues.push_back(std::unique_ptr<BatchQueue>(new BatchQueue()));
+  }
+}
+
+BatchExecutor::~BatchExecutor() {}
+
+void BatchExecutor::setInputScript(unsigned instance, const InputScript &script) {
+  instances[instance]->script = script;
+}
+
+void BatchExecutor::setFrameHook(FrameHook hook) {
+  this->hook = hook;
+}
+
+void BatchExecutor::resume(BatchInstance &instance) {
+  ucontext_t scheduler;
+  instance.scheduler = &scheduler;
+  instance.sliceEnd = std::min<uint64_t>(instance.frames + options.framesPerSlice, options.frames);
+
+  if (!instance.started) {
+    instance.started = true;
+    instance.stack.reset(new word[FIBER_STACK_SIZE]);
+    instance.runtime->setButtons(getScriptedButtons(instance.script, 0));
+
+    getcontext(&instance.context);
+    instance.context.uc_stack.ss_sp = instance.stack.get();
+    instance.context.uc_stack.ss_size = FIBER_STACK_SIZE;
+    instance.context.uc_link = NULL;
+    makecontext(&instance.context, runInstance, 0);
+    startingInstance = &instance;
+  }
+
+  swapcontext(&scheduler, &instance.context);
+  instance.scheduler = NULL;
+}
+
+void BatchExecutor::getStateRegions(BatchInstance &instance, vector<StateRegion> &regions) {
+  instance.runtime->getStateRegions(regions);
+  regions.push_back({(word *)&instance.context, sizeof(instance.context), 0});
+  regions.push_back({(word *)&instance.frames, sizeof(instance.frames), 0});
+  regions.push_back({(word *)&instance.stackLow, sizeof(instance.stackLow), 0});
+  regions.push_back({instance.stack.get(), FIBER_STACK_SIZE, instance.stackLow});
+}
+
+bool BatchExecutor::snapshot(unsigned index) {
+  BatchInstance &instance = *instances[index];
+  if (!instance.history || !instance.started || instance.finished) {
+    return false;
+  }
+
+  vector<StateRegion> regions;
+  getStateRegions(instance, regions);
+  instance.history->capture(regions);
+  return true;
+}
+
+bool BatchExecutor::rollback(unsigned index, size_t age) {
+  BatchInstance &instance = *instances[index];
+  if (!instance.history || !instance.started || instance.finished) {
+    return false;
+  }
+
+  vector<StateRegion> regions;
+  getStateRegions(instance, regions);
+  return instance.history->restore(age, regions);
+}
+
+vector<word> BatchExecutor::getMachineState(unsigned index) {
+  vector<StateRegion> regions;
+  instances[index]->runtime->getStateRegions(regions);
+  return flattenState(regions);
+}
+
+// Workers pop their own most recent instance, which is likely still warm
+// in their cache, and steal the oldest one from a neighbour otherwise.
+BatchInstance *BatchExecutor::takeWork(unsigned worker) {
+  for (unsigned i = 0; i < queues.size(); i++) {
+    BatchQueue &queue = *queues[(worker + i) % queues.size()];
+    lock_guard<mutex> guard(queue.lock);
+    if (queue.instances.empty()) {
+      continue;
+    }
+
+    BatchInstance *instance;
+    if (i == 0) {
+      instance = queue.instances.back();
+      queue.instances.pop_back();
+    } else {
+      instance = queue.instances.front();
+      queue.instances.pop_front();
+    }
+    return instance;
+  }
+  return NULL;
+}
+
+void BatchExecutor::runWorker(unsigned worker, BatchReport &report) {
+  BatchQueue &own = *queues[worker];
+  uint64_t frames = 0;
+  Clock::duration busy(0);
+
+  // Every live instance is either queued or running on a worker that will
+  // queue it again and look for work right after, so a worker that finds
+  // every queue empty has more company than instances and can retire.
+  while (BatchInstance *instance = takeWork(worker)) {
+    Clock::time_point start = Clock::now();
+    uint64_t before = instance->frames;
+    resume(*instance);
+    frames += instance->frames - before;
+    busy += Clock::now() - start;
+
+    if (hook) {
+      hook(instance->index, instance->frames, *instance->runtime);
+    }
+
+    if (!instance->finished && instance->frames < options.frames) {
+      lock_guard<mutex> guard(own.lock);
+      own.instances.push_back(instance);
+    }
+  }
+
+  report.workerFrames[worker] = frames;
+  report.workerSeconds[worker] = std::chrono::duration<double>(busy).count();
+}
+
+BatchReport BatchExecutor::run() {
+  BatchReport report;
+  report.frames = 0;
+  report.workerFrames.resize(queues.size());
+  report.workerSeconds.resize(queues.size());
+
+  for (unsigned i = 0; i < instances.size(); i++) {
+    queues[i % queues.size()]->instances.push_back(instances[i].get());
+  }
+
+  Clock::time_point start = Clock::now();
+  vector<thread> workers;
+  for (unsigned i = 0; i < queues.size(); i++) {
+    workers.push_back(thread([this, i, &report]() {
+      runWorker(i, report);
+    }));
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  report.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  for (auto frames : report.workerFrames) {
+    report.frames += frames;
+  }
+  return report;
+}
+
+double getRate(uint64_t frames, double seconds) {
+  return seconds > 0 ? frames / seconds : 0;
+}
+
+void printBatchReport(const BatchReport &report, std::ostream &out) {
+  double total = getRate(report.frames, report.seconds);
+  out << std::fixed << std::setprecision(1);
+  out << "Batch: " << report.frames << " frames in " << report.seconds << "s, " << total << " frames/s" << std::endl;
+
+  double single = 0;
+  for (unsigned i = 0; i < report.workerFrames.size(); i++) {
+    double rate = getRate(report.workerFrames[i], report.workerSeconds[i]);
+    single = std::max(single, rate);
+    out << "  worker " << i << ": " << report.workerFrames[i] << " frames, " << rate << " frames/s busy" << std::endl;
+  }
+
+  // Throughput relative to the busiest rate of a single worker; a value
+  // close to the worker count means workers rarely wait on each other.
+  if (single > 0) {
+    out << "Scaling: " << total / single << "x over " << report.workerFrames.size() << " workers" << std::endl;
+  }
+}
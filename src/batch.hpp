@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include "interpreter.hpp"
+#include "memory.hpp"
+#include "runtime.hpp"
+#include "savestate.hpp"
+
+class NesMachineSpec;
+struct BatchInstance;
+struct BatchQueue;
+
+// Controller state for each frame; the last entry is held once the script
+// runs out.
+typedef std::vector<word> InputScript;
+typedef std::function<void(unsigned instance, uint64_t frame, NesRuntime &runtime)> FrameHook;
+
+struct BatchOptions {
+  unsigned instances;
+  unsigned workers;
+  uint64_t frames;
+  unsigned framesPerSlice;
+  unsigned historySize;
+};
+
+struct BatchReport {
+  double seconds;
+  uint64_t frames;
+  std::vector<uint64_t> workerFrames;
+  std::vector<double> workerSeconds;
+};
+
+// Runs many independent instances of instanced code. Every instance lives
+// on its own fiber, which yields back to the worker thread at frame
+// boundaries, and idle workers steal suspended instances from each other.
+class BatchExecutor {
+  public:
+    BatchExecutor(const NesMachineSpec &machine, EntryPoint reset, NativeResolver resolver, const BatchOptions &options);
+    ~BatchExecutor();
+
+    void setInputScript(unsigned instance, const InputScript &script);
+    void setFrameHook(FrameHook hook);
+    BatchReport run();
+
+    // Only valid while the instance is suspended, such as from its own
+    // frame hook. Rollback restores the fiber along with the machine, so
+    // the instance resumes exactly where the snapshot was taken.
+    bool snapshot(unsigned instance);
+    bool rollback(unsigned instance, size_t age);
+
+    // Just the emulated machine, without the fiber, whose stack holds
+    // addresses that differ from one run to the next.
+    std::vector<word> getMachineState(unsigned instance);
+
+  private:
+    void runWorker(unsigned worker, BatchReport &report);
+    BatchInstance *takeWork(unsigned worker);
+    void resume(BatchInstance &instance);
+    void getStateRegions(BatchInstance &instance, std::vector<StateRegion> &regions);
+
+    BatchOptions options;
+    EntryPoint reset;
+    FrameHook hook;
+    std::vector<std::unique_ptr<BatchInstance>> instances;
+    std::vector<std::unique_ptr<BatchQueue>> queues;
+};
+
+void printBatchReport(const BatchReport &report, std::ostream &out);
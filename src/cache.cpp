@@ -0,0 +1,152 @@
+#include "cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#include <fstream>
+using std::ifstream;
+using std::ofstream;
+
+#include <sstream>
+using std::stringstream;
+
+#include <iomanip>
+using std::hex;
+using std::setfill;
+using std::setw;
+
+#include <string>
+using std::string;
+
+#include <thread>
+
+#include <sys/stat.h>
+
+#include "machine_spec.hpp"
+#include "program.hpp"
+
+const char *RECOMPILER_VERSION = "nes-recompiler 20";
+
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+void hashBytes(uint64_t &hash, const void *data, size_t length) {
+  const word *bytes = (const word *)data;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+}
+
+void hashAddr(uint64_t &hash, addr value) {
+  word bytes[2] = {(word)(value & 0xFF), (word)(value >> 8)};
+  hashBytes(hash, bytes, 2);
+}
+
+void hashSignature(uint64_t &hash, const FunctionSignature &signature) {
+  word bytes[2] = {signature.args, signature.rets};
+  hashBytes(hash, bytes, 2);
+}
+
+// Reads from ROM are folded into the generated code, so the data they
+// see is as much a part of the function as its instruction bytes.
+void hashReadOnlyOperand(uint64_t &hash, const DecodedInstruction &instruction, const MachineSpec &machine) {
+  addr length;
+  switch (instruction.mode) {
+    case MODE_ABS:
+      length = 1;
+      break;
+    case MODE_ABSX:
+    case MODE_ABSY:
+      length = 0x100;
+      break;
+    default:
+      return;
+  }
+
+  for (addr i = 0; i < length; i++) {
+    addr address = instruction.operand + i;
+    if (machine.isReadOnly(address)) {
+      word byte = machine.readWord(address);
+      hashBytes(hash, &byte, 1);
+    }
+  }
+}
+
+// Generated code also bakes in where ROM and PRG RAM live.
+void hashMemoryMap(uint64_t &hash, const MachineSpec &machine) {
+  bool prgRam = machine.hasPrgRam();
+  hashAddr(hash, machine.getPrgRomSize());
+  hashAddr(hash, machine.getPrgRomOffset());
+  hashBytes(hash, &prgRam, sizeof(prgRam));
+}
+
+uint64_t hashFunction(addr start, OptLevel optLevel, bool instanced, const Program &program) {
+  uint64_t hash = FNV_OFFSET;
+  hashBytes(hash, RECOMPILER_VERSION, strlen(RECOMPILER_VERSION));
+  hashBytes(hash, &optLevel, sizeof(optLevel));
+  hashBytes(hash, &instanced, sizeof(instanced));
+  hashAddr(hash, start);
+
+  const FunctionInfo &function = program.getFunction(start);
+  const MachineSpec &machine = program.getMachine();
+  hashMemoryMap(hash, machine);
+  hashSignature(hash, function.signature);
+  for (auto instAddress : function.instructions) {
+    const DecodedInstruction &instruction = program.getInstruction(instAddress);
+    hashAddr(hash, instAddress);
+    for (addr i = 0; i < instruction.length; i++) {
+      word byte = machine.readWord(instAddress + i);
+      hashBytes(hash, &byte, 1);
+    }
+    hashReadOnlyOperand(hash, instruction, machine);
+  }
+
+  for (auto callee : function.callees) {
+    hashAddr(hash, callee);
+    hashSignature(hash, program.getFunction(callee).signature);
+  }
+
+  return hash;
+}
+
+CodeCache::CodeCache(const string &directory) :
+  directory(directory)
+{
+  mkdir(directory.c_str(), 0755);
+}
+
+string CodeCache::getPath(uint64_t key) const {
+  stringstream path;
+  path << directory << "/" << hex << setfill('0') << setw(16) << key << ".bc";
+  return path.str();
+}
+
+bool CodeCache::lookup(uint64_t key, string &bitcode) const {
+  ifstream in(getPath(key).c_str(), std::ios::binary);
+  if (!in) {
+    return false;
+  }
+
+  stringstream contents;
+  contents << in.rdbuf();
+  bitcode = contents.str();
+  return !bitcode.empty();
+}
+
+void CodeCache::store(uint64_t key, const string &bitcode) const {
+  string path = getPath(key);
+
+  stringstream tmpPath;
+  tmpPath << path << ".tmp." << std::this_thread::get_id();
+
+  {
+    ofstream out(tmpPath.str().c_str(), std::ios::binary);
+    out.write(bitcode.data(), bitcode.size());
+    if (!out) {
+      std::remove(tmpPath.str().c_str());
+      return;
+    }
+  }
+
+  std::rename(tmpPath.str().c_str(), path.c_str());
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "backend.hpp"
+#include "memory.hpp"
+
+class Program;
+
+uint64_t hashFunction(addr start, OptLevel optLevel, bool instanced, const Program &program);
+
+class CodeCache {
+  public:
+    CodeCache(const std::string &directory);
+
+    bool lookup(uint64_t key, std::string &bitcode) const;
+    void store(uint64_t key, const std::string &bitcode) const;
+
+  private:
+    std::string getPath(uint64_t key) const;
+
+    std::string directory;
+};
@@ -1,7 +1,15 @@
 #include "codegen.hpp"
 
-#include <map>
-using std::map;
+#include <cctype>
+
+#include <memory>
+using std::unique_ptr;
+
+#include <string>
+using std::string;
+
+#include <vector>
+using std::vector;
 
 using llvm::Module;
 using llvm::IRBuilder;
@@ -13,44 +21,81 @@ using llvm::Constant;
 using llvm::Function;
 using llvm::BasicBlock;
 using llvm::ArrayRef;
-using llvm::getGlobalContext;
+using llvm::LLVMContext;
+using llvm::PHINode;
+using llvm::UndefValue;
+using llvm::PointerType;
+using llvm::FunctionType;
+using llvm::CallInst;
 
-ModuleGenerator::ModuleGenerator(const char *moduleName, const MachineSpec &machine) : 
+#include "machine_spec.hpp"
+
+ModuleGenerator::ModuleGenerator(const char *moduleName, const MachineSpec &machine, LLVMContext &context, bool instanced) : 
 machine (machine),
-module(moduleName, getGlobalContext())
+context(context),
+module(new Module(moduleName, context)),
+instanced(instanced)
 {
-  Type *fieldTypes[] = {getWordType(), getWordType(), getWordType(), getFlagType(), getFlagType(), getFlagType(), getFlagType()};
-  regStructType = StructType::create(ArrayRef<Type *>(fieldTypes, 7));
+  regStructType = getReturnType(ALL_REGISTERS);
+}
+
+LLVMContext &ModuleGenerator::getContext() const {
+  return context;
 }
 
 Module &ModuleGenerator::getModule() {
-  return module;
+  return *module;
 }
 
-const MachineSpec &ModuleGenerator::getMachine() const {
-  return machine;
+unique_ptr<Module> ModuleGenerator::releaseModule() {
+  return std::move(module);
 }
 
-void ModuleGenerator::write() const {
-  module.dump();
+const MachineSpec &ModuleGenerator::getMachine() const {
+  return machine;
 }
 
 Type *ModuleGenerator::getWordType() const {
-  return Type::getInt8Ty(getGlobalContext());
+  return Type::getInt8Ty(context);
 }
 
 Type *ModuleGenerator::getAddrType() const {
-  return Type::getInt16Ty(getGlobalContext());
+  return Type::getInt16Ty(context);
 }
 
 Type *ModuleGenerator::getFlagType() const {
-  return Type::getInt1Ty(getGlobalContext());
+  return Type::getInt1Ty(context);
+}
+
+Type *ModuleGenerator::getRegType(Register reg) const {
+  return reg <= REG_Y ? getWordType() : getFlagType();
 }
 
 StructType *ModuleGenerator::getRegStructType() const {
   return regStructType;
 }
 
+StructType *ModuleGenerator::getReturnType(RegisterMask rets) const {
+  vector<Type *> fieldTypes;
+  for (unsigned reg = 0; reg < REG_COUNT; reg++) {
+    if (rets & registerBit((Register)reg)) {
+      fieldTypes.push_back(getRegType((Register)reg));
+    }
+  }
+  return StructType::get(context, fieldTypes);
+}
+
+PointerType *ModuleGenerator::getStatePtrType() const {
+  return Type::getInt8PtrTy(context);
+}
+
+// Native entry points take the machine state, which only instanced code
+// uses, and the register file in memory.
+FunctionType *ModuleGenerator::getEntryType() const {
+  Type *args[] = {getStatePtrType(), PointerType::getUnqual(getRegStructType())};
+  return FunctionType::get(Type::getVoidTy(context), args, false);
+}
+
 Value *ModuleGenerator::getConstant(word val) const {
   return Constant::getIntegerValue(getWordType(), APInt(8, val));
 }
@@ -59,30 +104,55 @@ Value *ModuleGenerator::getConstant(addr val) const {
   return Constant::getIntegerValue(getAddrType(), APInt(16, val));
 }
 
-BlockGenerator::BlockGenerator(ModuleGenerator &moduleGenerator, BasicBlock *block, map<addr, BlockGenerator *> &blocks) : 
-  modgen(moduleGenerator),
-  builder(block),
-  blocks(blocks) {
-  phis[REG_A] = builder.CreatePHI(getWordType(), 0);
-  setRegValue(REG_A, phis[REG_A]);
+bool ModuleGenerator::isInstanced() const {
+  return instanced;
+}
 
-  phis[REG_X] = builder.CreatePHI(getWordType(), 0);
-  setRegValue(REG_X, phis[REG_X]);
+// Instanced code calls a separate family of runtime hooks that take the
+// machine state as their first argument.
+string ModuleGenerator::getHookName(const char *name) const {
+  if (!instanced) {
+    return name;
+  }
+  string result = string("instance") + name;
+  result[8] = toupper(result[8]);
+  return result;
+}
 
-  phis[REG_Y] = builder.CreatePHI(getWordType(), 0);
-  setRegValue(REG_Y, phis[REG_Y]);
+Function *ModuleGenerator::declareHook(const char *name, FunctionType *type) {
+  if (instanced) {
+    vector<Type *> args(1, getStatePtrType());
+    args.insert(args.end(), type->param_begin(), type->param_end());
+    type = FunctionType::get(type->getReturnType(), args, false);
+  }
+  return Function::Create(type, Function::ExternalLinkage, getHookName(name), module.get());
+}
 
-  phis[REG_N] = builder.CreatePHI(getFlagType(), 0);
-  setRegValue(REG_N, phis[REG_N]);
+void ModuleGenerator::setSignature(addr start, const FunctionSignature &signature) {
+  signatures[start] = signature;
+}
 
-  phis[REG_V] = builder.CreatePHI(getFlagType(), 0);
-  setRegValue(REG_V, phis[REG_V]);
+const FunctionSignature &ModuleGenerator::getSignature(addr start) const {
+  return signatures.at(start);
+}
 
-  phis[REG_Z] = builder.CreatePHI(getFlagType(), 0);
-  setRegValue(REG_Z, phis[REG_Z]);
+BlockGenerator::BlockGenerator(ModuleGenerator &moduleGenerator, addr function, BasicBlock *block, AddrMap<BlockGenerator *> &blocks, const AddrMap<Value *> &promotedWords) : 
+  function(function),
+  entryBlock(block),
+  builder(block),
+  modgen(moduleGenerator),
+  blocks(blocks),
+  promotedWords(promotedWords),
+  sealed(false) {
+  for (unsigned reg = 0; reg < REG_COUNT; reg++) {
+    values[reg] = NULL;
+    lazyFlags[reg].kind = FLAG_NONE;
+    incompletePhis[reg] = NULL;
+  }
+}
 
-  phis[REG_C] = builder.CreatePHI(getFlagType(), 0);
-  setRegValue(REG_C, phis[REG_C]);
+LLVMContext &BlockGenerator::getContext() const {
+  return modgen.getContext();
 }
 
 Module &BlockGenerator::getModule() {
@@ -97,6 +167,10 @@ BasicBlock *BlockGenerator::getBlock() {
   return builder.GetInsertBlock();
 }
 
+BasicBlock *BlockGenerator::getEntryBlock() {
+  return entryBlock;
+}
+
 IRBuilder<> &BlockGenerator::getBuilder() {
   return builder;
 }
@@ -113,10 +187,22 @@ Type *BlockGenerator::getFlagType() const {
   return modgen.getFlagType();
 }
 
+Type *BlockGenerator::getRegType(Register reg) const {
+  return modgen.getRegType(reg);
+}
+
 StructType *BlockGenerator::getRegStructType() const {
   return modgen.getRegStructType();
 }
 
+StructType *BlockGenerator::getReturnType(RegisterMask rets) const {
+  return modgen.getReturnType(rets);
+}
+
+FunctionType *BlockGenerator::getEntryType() const {
+  return modgen.getEntryType();
+}
+
 Value *BlockGenerator::getConstant(word val) const {
   return modgen.getConstant(val);
 }
@@ -125,43 +211,234 @@ Value *BlockGenerator::getConstant(addr val) const {
   return modgen.getConstant(val);
 }
 
+bool BlockGenerator::isInstanced() const {
+  return modgen.isInstanced();
+}
+
+Value *BlockGenerator::getStatePointer() {
+  if (!isInstanced()) {
+    return llvm::ConstantPointerNull::get(modgen.getStatePtrType());
+  }
+  return &*entryBlock->getParent()->arg_begin();
+}
+
+CallInst *BlockGenerator::createHookCall(const char *name, ArrayRef<Value *> args) {
+  vector<Value *> hookArgs;
+  if (isInstanced()) {
+    hookArgs.push_back(getStatePointer());
+  }
+  hookArgs.insert(hookArgs.end(), args.begin(), args.end());
+  Function *hook = getModule().getFunction(modgen.getHookName(name));
+  return builder.CreateCall(hook, hookArgs);
+}
+
+addr BlockGenerator::getFunction() const {
+  return function;
+}
+
+const FunctionSignature &BlockGenerator::getSignature(addr start) const {
+  return modgen.getSignature(start);
+}
+
 Value *BlockGenerator::getRegValue(Register reg) {
+  if (lazyFlags[reg].kind != FLAG_NONE) {
+    return materializeFlag(reg);
+  }
+  return readVariable(reg);
+}
+
+Value *BlockGenerator::materializeFlag(Register reg) {
+  LazyFlag &flag = lazyFlags[reg];
+  BasicBlock *current = builder.GetInsertBlock();
+  IRBuilder<> flagBuilder(current);
+  if (current->getTerminator()) {
+    flagBuilder.SetInsertPoint(current->getTerminator());
+  }
+
+  Value *zero = Constant::getNullValue(flag.lhs->getType());
+  switch (flag.kind) {
+    case FLAG_NEGATIVE:
+      values[reg] = flagBuilder.CreateICmpSLT(flag.lhs, zero);
+      break;
+    case FLAG_ZERO:
+      values[reg] = flagBuilder.CreateICmpEQ(flag.lhs, zero);
+      break;
+    case FLAG_UNSIGNED_GE:
+      values[reg] = flagBuilder.CreateICmpUGE(flag.lhs, flag.rhs);
+      break;
+    default:
+      values[reg] = flagBuilder.CreateICmpNE(flagBuilder.CreateAnd(flag.lhs, flag.rhs), zero);
+  }
+  flag.kind = FLAG_NONE;
   return values[reg];
 }
 
+Value *BlockGenerator::readVariable(Register reg) {
+  if (values[reg]) {
+    return values[reg];
+  }
+
+  Value *value;
+  if (!sealed) {
+    PHINode *phi = createPhi(reg);
+    incompletePhis[reg] = phi;
+    value = phi;
+  } else if (predecessors.empty()) {
+    value = UndefValue::get(getRegType(reg));
+  } else if (predecessors.size() == 1) {
+    value = predecessors[0].generator->getRegValue(reg);
+  } else {
+    PHINode *phi = createPhi(reg);
+    values[reg] = phi;
+    value = addPhiOperands(reg, phi);
+  }
+
+  values[reg] = value;
+  return value;
+}
+
+PHINode *BlockGenerator::createPhi(Register reg) {
+  PHINode *phi;
+  if (entryBlock->empty()) {
+    phi = PHINode::Create(getRegType(reg), 0, "", entryBlock);
+  } else {
+    phi = PHINode::Create(getRegType(reg), 0, "", &entryBlock->front());
+  }
+  phis.push_back(phi);
+  return phi;
+}
+
+Value *BlockGenerator::addPhiOperands(Register reg, PHINode *phi) {
+  for (auto &pred : predecessors) {
+    phi->addIncoming(pred.generator->getRegValue(reg), pred.block);
+  }
+  return tryRemoveTrivialPhi(phi);
+}
+
+Value *BlockGenerator::tryRemoveTrivialPhi(PHINode *phi) {
+  Value *same = NULL;
+  for (unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
+    Value *op = phi->getIncomingValue(i);
+    if (op == same || op == phi) {
+      continue;
+    }
+    if (same) {
+      return phi;
+    }
+    same = op;
+  }
+
+  if (!same) {
+    same = UndefValue::get(phi->getType());
+  }
+
+  vector<PHINode *> users;
+  for (auto user : phi->users()) {
+    PHINode *userPhi = llvm::dyn_cast<PHINode>(user);
+    if (userPhi && userPhi != phi) {
+      users.push_back(userPhi);
+    }
+  }
+
+  phi->replaceAllUsesWith(same);
+  for (auto blockStart : blocks.keys()) {
+    blocks[blockStart]->replaceValue(phi, same);
+  }
+
+  for (auto user : users) {
+    tryRemoveTrivialPhi(user);
+  }
+  return same;
+}
+
+void BlockGenerator::replaceValue(Value *from, Value *to) {
+  for (unsigned reg = 0; reg < REG_COUNT; reg++) {
+    if (values[reg] == from) {
+      values[reg] = to;
+    }
+    if (lazyFlags[reg].lhs == from) {
+      lazyFlags[reg].lhs = to;
+    }
+    if (lazyFlags[reg].rhs == from) {
+      lazyFlags[reg].rhs = to;
+    }
+  }
+}
+
 void BlockGenerator::setRegValue(Register reg, Value *val) {
+  lazyFlags[reg].kind = FLAG_NONE;
   values[reg] = val;
 }
 
-void BlockGenerator::addIncomingValue(Register reg, Value *val, BasicBlock *block) {
-  phis[reg]->addIncoming(val, block);
+void BlockGenerator::setLazyFlag(Register reg, FlagKind kind, Value *lhs, Value *rhs) {
+  lazyFlags[reg].kind = kind;
+  lazyFlags[reg].lhs = lhs;
+  lazyFlags[reg].rhs = rhs;
 }
 
-void BlockGenerator::addIncomingValues(BlockGenerator &blockgen) {
-  BasicBlock *myBlock = getBlock();
-  blockgen.addIncomingValue(REG_A, getRegValue(REG_A), myBlock);
-  blockgen.addIncomingValue(REG_X, getRegValue(REG_X), myBlock);
-  blockgen.addIncomingValue(REG_Y, getRegValue(REG_Y), myBlock);
-  blockgen.addIncomingValue(REG_N, getRegValue(REG_N), myBlock);
-  blockgen.addIncomingValue(REG_V, getRegValue(REG_V), myBlock);
-  blockgen.addIncomingValue(REG_Z, getRegValue(REG_Z), myBlock);
-  blockgen.addIncomingValue(REG_C, getRegValue(REG_C), myBlock);
+void BlockGenerator::setResultFlags(Value *result) {
+  setLazyFlag(REG_N, FLAG_NEGATIVE, result);
+  setLazyFlag(REG_Z, FLAG_ZERO, result);
 }
 
-void BlockGenerator::addIncomingValues(addr blockStart) {
-  addIncomingValues(*(blocks[blockStart]));
+void BlockGenerator::addPredecessor(BlockGenerator &blockgen) {
+  Predecessor pred = {&blockgen, blockgen.getBlock()};
+  predecessors.push_back(pred);
 }
 
 void BlockGenerator::generateJump(addr targetBlock) {
   BlockGenerator *target = blocks[targetBlock];
-  builder.CreateBr(target->getBlock());
-  addIncomingValues(*target);
+  builder.CreateBr(target->getEntryBlock());
+  target->addPredecessor(*this);
 }
 
 void BlockGenerator::generateConditionalJump(Value *condition, addr trueBlock, addr falseBlock) {
   BlockGenerator *trueGen = blocks[trueBlock];
   BlockGenerator *falseGen = blocks[falseBlock];
-  builder.CreateCondBr(condition, trueGen->getBlock(), falseGen->getBlock());
-  addIncomingValues(*trueGen);
-  addIncomingValues(*falseGen);
+  builder.CreateCondBr(condition, trueGen->getEntryBlock(), falseGen->getEntryBlock());
+  trueGen->addPredecessor(*this);
+  falseGen->addPredecessor(*this);
+}
+
+void BlockGenerator::seal() {
+  for (unsigned reg = 0; reg < REG_COUNT; reg++) {
+    if (incompletePhis[reg]) {
+      addPhiOperands((Register)reg, incompletePhis[reg]);
+      incompletePhis[reg] = NULL;
+    }
+  }
+  sealed = true;
+}
+
+bool BlockGenerator::removeDeadPhis() {
+  bool changed = false;
+  for (auto it = phis.begin(); it != phis.end();) {
+    if ((*it)->use_empty()) {
+      (*it)->eraseFromParent();
+      it = phis.erase(it);
+      changed = true;
+    } else {
+      ++it;
+    }
+  }
+  return changed;
+}
+
+Value *BlockGenerator::getPromotedWord(addr address) const {
+  Value *const *slot = promotedWords.find(address);
+  return slot ? *slot : NULL;
+}
+
+// Promoted zero-page words live in allocas, which mem2reg turns into SSA
+// values. Memory is only brought up to date where other code may see it.
+void BlockGenerator::spillPromotedWords() {
+  for (auto address : promotedWords.keys()) {
+    getMachine().generateStore(address, builder.CreateLoad(promotedWords.at(address)), *this);
+  }
+}
+
+void BlockGenerator::reloadPromotedWords() {
+  for (auto address : promotedWords.keys()) {
+    builder.CreateStore(getMachine().generateLoad(address, *this), promotedWords.at(address));
+  }
 }
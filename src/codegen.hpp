@@ -1,71 +1,129 @@
 #pragma once
 
-#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 
+#include "addr_map.hpp"
 #include "memory.hpp"
+#include "registers.hpp"
 
 class MachineSpec;
 class Instruction;
 
 class ModuleGenerator {
   public:
-    ModuleGenerator(const char *moduleName, const MachineSpec &machine);
+    ModuleGenerator(const char *moduleName, const MachineSpec &machine, llvm::LLVMContext &context, bool instanced = false);
 
+    llvm::LLVMContext &getContext() const;
     llvm::Module &getModule();
+    std::unique_ptr<llvm::Module> releaseModule();
     const MachineSpec &getMachine() const;
-    void write() const;
     llvm::Type *getWordType() const;
     llvm::Type *getAddrType() const;
     llvm::Type *getFlagType() const;
+    llvm::Type *getRegType(Register reg) const;
     llvm::StructType *getRegStructType() const;
+    llvm::StructType *getReturnType(RegisterMask rets) const;
+    llvm::PointerType *getStatePtrType() const;
+    llvm::FunctionType *getEntryType() const;
     llvm::Value *getConstant(word val) const;
     llvm::Value *getConstant(addr val) const;
 
+    bool isInstanced() const;
+    std::string getHookName(const char *name) const;
+    llvm::Function *declareHook(const char *name, llvm::FunctionType *type);
+
+    void setSignature(addr start, const FunctionSignature &signature);
+    const FunctionSignature &getSignature(addr start) const;
+
   private:
-    llvm::Module module;
+    llvm::LLVMContext &context;
+    std::unique_ptr<llvm::Module> module;
     const MachineSpec &machine;
+    bool instanced;
     llvm::StructType *regStructType;
+    AddrMap<FunctionSignature> signatures;
+};
+
+enum FlagKind {
+  FLAG_NONE,
+  FLAG_NEGATIVE,
+  FLAG_ZERO,
+  FLAG_UNSIGNED_GE,
+  FLAG_BITS_SET
 };
 
-enum Register {
-  REG_A,
-  REG_X,
-  REG_Y,
-  REG_N,
-  REG_V,
-  REG_Z,
-  REG_C
+struct LazyFlag {
+  FlagKind kind;
+  llvm::Value *lhs;
+  llvm::Value *rhs;
 };
 
 class BlockGenerator {
   public:
-    BlockGenerator(ModuleGenerator &moduleGenerator, llvm::BasicBlock *block, std::map<addr, BlockGenerator *> &blocks);
+    BlockGenerator(ModuleGenerator &moduleGenerator, addr function, llvm::BasicBlock *block, AddrMap<BlockGenerator *> &blocks, const AddrMap<llvm::Value *> &promotedWords);
 
+    llvm::LLVMContext &getContext() const;
     llvm::Module &getModule();
     const MachineSpec &getMachine() const;
     llvm::IRBuilder<> &getBuilder();
     llvm::BasicBlock *getBlock();
+    llvm::BasicBlock *getEntryBlock();
     llvm::Type *getWordType() const;
     llvm::Type *getAddrType() const;
     llvm::Type *getFlagType() const;
+    llvm::Type *getRegType(Register reg) const;
     llvm::StructType *getRegStructType() const;
+    llvm::StructType *getReturnType(RegisterMask rets) const;
+    llvm::FunctionType *getEntryType() const;
     llvm::Value *getConstant(word val) const;
     llvm::Value *getConstant(addr val) const;
+    bool isInstanced() const;
+    llvm::Value *getStatePointer();
+    llvm::CallInst *createHookCall(const char *name, llvm::ArrayRef<llvm::Value *> args);
+    addr getFunction() const;
+    const FunctionSignature &getSignature(addr start) const;
     llvm::Value *getRegValue(Register);
     void setRegValue(Register reg, llvm::Value *val);
-    void addIncomingValue(Register reg, llvm::Value *val, llvm::BasicBlock *block);
-    void addIncomingValues(BlockGenerator &blockgen);
-    void addIncomingValues(addr blockStart);
+    void setLazyFlag(Register reg, FlagKind kind, llvm::Value *lhs, llvm::Value *rhs = NULL);
+    void setResultFlags(llvm::Value *result);
+    void addPredecessor(BlockGenerator &blockgen);
     void generateJump(addr targetBlock);
     void generateConditionalJump(llvm::Value *condition, addr trueBlock, addr falseBlock);
+    void seal();
+    bool removeDeadPhis();
+    llvm::Value *getPromotedWord(addr address) const;
+    void spillPromotedWords();
+    void reloadPromotedWords();
 
   private:
+    struct Predecessor {
+      BlockGenerator *generator;
+      llvm::BasicBlock *block;
+    };
+
+    llvm::Value *materializeFlag(Register reg);
+    llvm::Value *readVariable(Register reg);
+    llvm::PHINode *createPhi(Register reg);
+    llvm::Value *addPhiOperands(Register reg, llvm::PHINode *phi);
+    llvm::Value *tryRemoveTrivialPhi(llvm::PHINode *phi);
+    void replaceValue(llvm::Value *from, llvm::Value *to);
+
+    addr function;
+    llvm::BasicBlock *entryBlock;
     llvm::IRBuilder<> builder;
-    std::map<Register, llvm::Value *> values;
     ModuleGenerator &modgen;
-    std::map<addr, BlockGenerator *> &blocks;
-    std::map<Register, llvm::PHINode *> phis;
+    AddrMap<BlockGenerator *> &blocks;
+    const AddrMap<llvm::Value *> &promotedWords;
+    std::vector<Predecessor> predecessors;
+    bool sealed;
+    llvm::Value *values[REG_COUNT];
+    LazyFlag lazyFlags[REG_COUNT];
+    llvm::PHINode *incompletePhis[REG_COUNT];
+    std::vector<llvm::PHINode *> phis;
 };
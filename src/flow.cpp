@@ -1,17 +1,10 @@
 #include "flow.hpp"
 
-#include <map>
-using std::map;
-
-#include <set>
-using std::set;
+#include <algorithm>
 
 #include <stack>
 using std::stack;
 
-#include <memory>
-using std::unique_ptr;
-
 #include <vector>
 using std::vector;
 
@@ -19,12 +12,17 @@ using std::vector;
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 using llvm::Module;
+using llvm::LLVMContext;
 using llvm::Type;
+using llvm::PointerType;
+using llvm::StructType;
+using llvm::Value;
 using llvm::FunctionType;
 using llvm::Function;
-using llvm::getGlobalContext;
 using llvm::BasicBlock;
 using llvm::IRBuilder;
+using llvm::UndefValue;
+using llvm::CallInst;
 
 #include <iostream>
 
@@ -39,96 +37,418 @@ using std::stringstream;
 
 #include "instruction.hpp"
 #include "machine_spec.hpp"
+#include "addr_map.hpp"
 #include "codegen.hpp"
+#include "liveness.hpp"
+#include "program.hpp"
 
-void identifyFunction(addr start, const MachineSpec &machine, set<addr> &out) {
+void identifyFunction(addr start, Program &program, AddrSet &out) {
   stack<addr> remaining;
   remaining.push(start);
 
   while (!remaining.empty()) {
     addr address = remaining.top();
     remaining.pop();
-    if (!out.insert(address).second) {
+    if (!out.insert(address)) {
       continue;
     }
 
-    unique_ptr<Instruction> instruction(readInstruction(address, machine));
+    const DecodedInstruction &instruction = program.decode(address);
 
-    if (instruction->isTerminal()) {
+    if (instruction.isTerminal()) {
       continue;
     }
 
-    if (instruction->isBranch()) {
-      remaining.push(instruction->getBranchTarget());
+    if (instruction.isBranch()) {
+      remaining.push(instruction.getBranchTarget());
     }
 
-    remaining.push(instruction->getFollowingLocation());
+    remaining.push(instruction.getFollowingLocation());
   }
 }
 
-void identifyBlocks(addr start, const set<addr> &function, const MachineSpec &machine, set<addr> &out) {
+void identifyBlocks(addr start, const AddrSet &function, Program &program, AddrSet &out) {
   out.insert(start);
-  for (set<addr>::iterator it = function.begin(); it != function.end(); it++) {
-    unique_ptr<Instruction> instruction(readInstruction(*it, machine));
-    if (instruction->isBranch()) {
-      out.insert(instruction->getFollowingLocation());
-      out.insert(instruction->getBranchTarget());
+  for (auto instAddress : function) {
+    const DecodedInstruction &instruction = program.decode(instAddress);
+    if (instruction.isBranch()) {
+      out.insert(instruction.getFollowingLocation());
+      out.insert(instruction.getBranchTarget());
+    }
+  }
+}
+
+struct PointerTable {
+  addr low;
+  addr high;
+  Register index;
+  word offset;
+};
+
+const unsigned MAX_DISPATCH_LOOKBACK = 8;
+const unsigned MAX_GUARD_LOOKBACK = 16;
+const unsigned PLAUSIBLE_TARGET_LENGTH = 8;
+
+bool findPrevious(addr location, const AddrSet &function, Program &program, addr &out) {
+  for (addr length = 1; length <= 3; length++) {
+    addr candidate = location - length;
+    if (function.count(candidate) && program.decode(candidate).getFollowingLocation() == location) {
+      out = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool getLoadRegister(const DecodedInstruction &inst, Register &reg) {
+  switch (inst.opcode) {
+    case OP_LDA: reg = REG_A; return true;
+    case OP_LDX: reg = REG_X; return true;
+    case OP_LDY: reg = REG_Y; return true;
+    default: return false;
+  }
+}
+
+bool getStoreRegister(const DecodedInstruction &inst, Register &reg) {
+  if (inst.mode != MODE_ZPG && inst.mode != MODE_ABS) {
+    return false;
+  }
+
+  switch (inst.opcode) {
+    case OP_STA: reg = REG_A; return true;
+    case OP_STX: reg = REG_X; return true;
+    case OP_STY: reg = REG_Y; return true;
+    default: return false;
+  }
+}
+
+bool getTableIndex(const DecodedInstruction &inst, const MachineSpec &machine, Register &index) {
+  if (inst.mode == MODE_ABSX) {
+    index = REG_X;
+  } else if (inst.mode == MODE_ABSY) {
+    index = REG_Y;
+  } else {
+    return false;
+  }
+  return machine.isReadOnly(inst.operand);
+}
+
+// JMP ($ptr) after LDx low,i / STx ptr / LDx high,i / STx ptr+1, in either order.
+bool matchJumpTable(addr location, const AddrSet &function, Program &program, PointerTable &out) {
+  const MachineSpec &machine = program.getMachine();
+  addr pointer = program.decode(location).operand;
+
+  bool pending[REG_C + 1] = {false};
+  bool pendingHigh[REG_C + 1] = {false};
+  bool foundLow = false, foundHigh = false;
+
+  addr current = location;
+  for (unsigned i = 0; i < MAX_DISPATCH_LOOKBACK && !(foundLow && foundHigh); i++) {
+    if (!findPrevious(current, function, program, current)) {
+      return false;
+    }
+
+    const DecodedInstruction &inst = program.decode(current);
+    Register reg, index;
+
+    if (getStoreRegister(inst, reg) && (inst.operand == pointer || inst.operand == (addr)(pointer + 1))) {
+      pending[reg] = true;
+      pendingHigh[reg] = inst.operand != pointer;
+    } else if (getLoadRegister(inst, reg) && pending[reg]) {
+      if (!getTableIndex(inst, machine, index) || ((foundLow || foundHigh) && index != out.index)) {
+        return false;
+      }
+
+      out.index = index;
+      if (pendingHigh[reg]) {
+        out.high = inst.operand;
+        foundHigh = true;
+      } else {
+        out.low = inst.operand;
+        foundLow = true;
+      }
+      pending[reg] = false;
+    } else if (foundLow || foundHigh) {
+      RegisterMask uses, defs;
+      getInstructionEffects(inst, uses, defs);
+      if (defs & registerBit(out.index)) {
+        return false;
+      }
+    }
+  }
+
+  out.offset = 0;
+  return foundLow && foundHigh;
+}
+
+// LDA high,i / PHA / LDA low,i / PHA / RTS
+bool matchReturnTable(addr location, const AddrSet &function, Program &program, PointerTable &out) {
+  const MachineSpec &machine = program.getMachine();
+
+  addr previous;
+  if (!findPrevious(location, function, program, previous)) {
+    return false;
+  }
+
+  const DecodedInstruction &loadHigh = program.decode(previous);
+  const DecodedInstruction &loadLow = program.decode(location + 1);
+  const DecodedInstruction &pushLow = program.decode(loadLow.getFollowingLocation());
+  const DecodedInstruction &ret = program.decode(pushLow.getFollowingLocation());
+
+  Register highIndex, lowIndex;
+  if (loadHigh.opcode != OP_LDA || loadLow.opcode != OP_LDA || pushLow.opcode != OP_PHA || ret.opcode != OP_RTS ||
+      !getTableIndex(loadHigh, machine, highIndex) || !getTableIndex(loadLow, machine, lowIndex) || highIndex != lowIndex) {
+    return false;
+  }
+
+  out.low = loadLow.operand;
+  out.high = loadHigh.operand;
+  out.index = lowIndex;
+  out.offset = 1;
+  return true;
+}
+
+bool isIndexCompare(const DecodedInstruction &inst, Register reg) {
+  if (inst.mode != MODE_IMM) {
+    return false;
+  }
+
+  switch (inst.opcode) {
+    case OP_CMP: return reg == REG_A;
+    case OP_CPX: return reg == REG_X;
+    case OP_CPY: return reg == REG_Y;
+    default: return false;
+  }
+}
+
+// Finds the single instruction that leads to location, either by falling
+// through or by a taken branch.
+bool findOnlyPredecessor(addr location, const FunctionInfo &function, Program &program, addr &out, bool &taken) {
+  if (location == function.start) {
+    return false;
+  }
+
+  unsigned count = 0;
+  for (auto instAddress : function.instructions) {
+    const DecodedInstruction &inst = program.decode(instAddress);
+    if (!inst.isTerminal() && inst.getFollowingLocation() == location) {
+      out = instAddress;
+      taken = false;
+      count++;
+    }
+    if (inst.isBranch() && inst.getBranchTarget() == location) {
+      out = instAddress;
+      taken = true;
+      count++;
+    }
+  }
+  return count == 1;
+}
+
+// A CMP/CPX/CPY #n that every path to the dispatch leaves through the
+// BCS fallthrough or the BCC target bounds the index below n. The index is
+// followed back through TAX/TAY and ASL A, which scale the bound with it.
+// Returns the bound on the table offset, or zero if there is none.
+unsigned findIndexBound(addr location, Register index, const FunctionInfo &function, Program &program) {
+  Register reg = index;
+  unsigned scale = 1;
+
+  addr current = location;
+  for (unsigned i = 0; i < MAX_GUARD_LOOKBACK; i++) {
+    addr previous, compare;
+    bool taken, compareTaken;
+    if (!findOnlyPredecessor(current, function, program, previous, taken)) {
+      return 0;
+    }
+
+    const DecodedInstruction &inst = program.decode(previous);
+    if ((inst.opcode == OP_BCS && !taken) || (inst.opcode == OP_BCC && taken)) {
+      if (findOnlyPredecessor(previous, function, program, compare, compareTaken) && !compareTaken) {
+        const DecodedInstruction &guard = program.decode(compare);
+        if (isIndexCompare(guard, reg) && guard.operand > 0) {
+          return guard.operand * scale;
+        }
+      }
+    } else if (inst.opcode == OP_ASL && inst.mode == MODE_ACC && reg == REG_A) {
+      scale *= 2;
+    } else if ((inst.opcode == OP_TAX && reg == REG_X) || (inst.opcode == OP_TAY && reg == REG_Y)) {
+      reg = REG_A;
+    } else {
+      RegisterMask uses, defs;
+      getInstructionEffects(inst, uses, defs);
+      if (defs & registerBit(reg)) {
+        return 0;
+      }
+    }
+    current = previous;
+  }
+  return 0;
+}
+
+// Without a bound, a table ends where its entries stop looking like
+// pointers to code: each target has to start a run of known instructions
+// other than BRK that stays in ROM until it ends.
+bool isPlausibleTarget(addr target, Program &program) {
+  const MachineSpec &machine = program.getMachine();
+  addr address = target;
+  for (unsigned i = 0; i < PLAUSIBLE_TARGET_LENGTH; i++) {
+    if (!machine.isReadOnly(address)) {
+      return false;
+    }
+
+    const DecodedInstruction &inst = program.decode(address);
+    if (inst.opcode == OP_UNKNOWN || inst.opcode == OP_BRK) {
+      return false;
+    }
+    if (inst.isTerminal()) {
+      return true;
+    }
+    address = inst.getFollowingLocation();
+  }
+  return true;
+}
+
+void findTableTargets(addr location, const PointerTable &table, const FunctionInfo &function, Program &program, AddrSet &out) {
+  const MachineSpec &machine = program.getMachine();
+  unsigned stride = table.high == table.low + 1 ? 2 : 1;
+  unsigned bound = findIndexBound(location, table.index, function, program);
+  unsigned count = bound ? (bound + stride - 1) / stride : 256 / stride;
+
+  // The halves of a split table can't overlap.
+  if (stride == 1) {
+    count = std::min<unsigned>(count, table.low < table.high ? table.high - table.low : table.low - table.high);
+  }
+
+  for (unsigned i = 0; i < count; i++) {
+    addr low = table.low + i * stride;
+    addr high = table.high + i * stride;
+    if (!machine.isReadOnly(low) || !machine.isReadOnly(high)) {
+      break;
+    }
+
+    addr target = machine.readWord(low) + 256 * machine.readWord(high) + table.offset;
+    if (bound) {
+      if (!machine.isReadOnly(target) || program.decode(target).opcode == OP_UNKNOWN) {
+        break;
+      }
+    } else if (function.instructions.count(low) || function.instructions.count(high) || !isPlausibleTarget(target, program)) {
+      break;
+    }
+    out.insert(target);
+  }
+}
+
+void findDispatchTargets(const FunctionInfo &function, Program &program, AddrSet &out) {
+  for (auto instAddress : function.instructions) {
+    const DecodedInstruction &inst = program.decode(instAddress);
+    PointerTable table;
+
+    if (inst.opcode == OP_JMP && inst.mode == MODE_IND && matchJumpTable(instAddress, function.instructions, program, table)) {
+      findTableTargets(instAddress, table, function, program, out);
+    } else if (inst.opcode == OP_PHA && matchReturnTable(instAddress, function.instructions, program, table)) {
+      findTableTargets(instAddress, table, function, program, out);
     }
   }
 }
 
-void findReachableFunctions(addr start, const MachineSpec &machine, set<addr> &out) {
+void findReachableFunctions(const AddrSet &roots, Program &program) {
   stack<addr> remaining;
-  remaining.push(start);
+  for (auto root : roots) {
+    remaining.push(root);
+  }
 
   while (!remaining.empty()) {
     addr address = remaining.top();
     remaining.pop();
-    if (!out.insert(address).second) {
+    if (program.hasFunction(address)) {
       continue;
     }
 
-    set<addr> function;
-    identifyFunction(address, machine, function);
+    FunctionInfo &function = program.addFunction(address);
+    identifyFunction(address, program, function.instructions);
+    identifyBlocks(address, function.instructions, program, function.blocks);
 
-    for (auto instAddress : function) {
-      unique_ptr<Instruction> instruction(readInstruction(instAddress, machine));
+    for (auto instAddress : function.instructions) {
+      const DecodedInstruction &instruction = program.decode(instAddress);
 
-      if (instruction->isCall()) {
-        remaining.push(instruction->getCallTarget());
+      if (instruction.isCall()) {
+        function.callees.insert(instruction.getCallTarget());
+        remaining.push(instruction.getCallTarget());
       }
     }
+
+    AddrSet targets;
+    findDispatchTargets(function, program, targets);
+    for (auto target : targets) {
+      function.callees.insert(target);
+      remaining.push(target);
+    }
+  }
+
+  computeSignatures(program);
+}
+
+void findReachableFunctions(addr start, Program &program) {
+  AddrSet roots;
+  roots.insert(start);
+  findReachableFunctions(roots, program);
+}
+
+bool hasFallback(addr start, const Program &program) {
+  for (auto instAddress : program.getFunction(start).instructions) {
+    if (program.getInstruction(instAddress).needsFallback()) {
+      return true;
+    }
   }
+  return false;
 }
 
-void declareFunction(addr start, bool external, ModuleGenerator &modgen) {
+void declareFunction(addr start, const FunctionSignature &signature, bool external, ModuleGenerator &modgen) {
   char name[7];
   sprintf(name, "f_%04X", start);
 
+  const char *argName[] = {"A", "X", "Y", "N", "V", "Z", "C"};
+
   vector<Type *> args;
-  args.push_back(Type::getInt8Ty(getGlobalContext()));
-  args.push_back(Type::getInt8Ty(getGlobalContext()));
-  args.push_back(Type::getInt8Ty(getGlobalContext()));
-  args.push_back(Type::getInt1Ty(getGlobalContext()));
-  args.push_back(Type::getInt1Ty(getGlobalContext()));
-  args.push_back(Type::getInt1Ty(getGlobalContext()));
-  args.push_back(Type::getInt1Ty(getGlobalContext()));
-  FunctionType *ft = FunctionType::get(modgen.getRegStructType(), args, false);
+  vector<const char *> names;
+  if (modgen.isInstanced()) {
+    args.push_back(modgen.getStatePtrType());
+    names.push_back("state");
+  }
+  for (unsigned reg = 0; reg < REG_COUNT; reg++) {
+    if (signature.args & registerBit((Register)reg)) {
+      args.push_back(modgen.getRegType((Register)reg));
+      names.push_back(argName[reg]);
+    }
+  }
+  FunctionType *ft = FunctionType::get(modgen.getReturnType(signature.rets), args, false);
   Function *func = Function::Create(ft, external ? Function::ExternalLinkage : Function::PrivateLinkage, name, &(modgen.getModule()));
-
-  const char *argName[] = {"A", "X", "Y", "N", "V", "Z", "C"};
+  func->setCallingConv(llvm::CallingConv::Fast);
+  modgen.setSignature(start, signature);
 
   int i = 0;
   for (auto &arg : func->args()) {
-    arg.setName(argName[i++]);
+    arg.setName(names[i++]);
   }
 }
 
-void writeBlock(addr start, addr end, BlockGenerator &blockgen) {
-  std::unique_ptr<Instruction> lastInstruction;
+void writeBlock(addr start, addr end, unsigned pollCycles, const AddrMap<unsigned> &loopJumps, const AddrSet &idleLoops, const Program &program, BlockGenerator &blockgen) {
+  const DecodedInstruction *lastInstruction = NULL;
+
+  if (pollCycles) {
+    program.getMachine().generateInterruptPoll(pollCycles, blockgen);
+  }
 
   while (start < end) {
-    lastInstruction.reset(readInstruction(start, blockgen.getMachine()));
+    lastInstruction = &program.getInstruction(start);
+    if (idleLoops.count(start)) {
+      Value *waiting = lastInstruction->isBranch() ? generateBranchTaken(*lastInstruction, blockgen) : blockgen.getBuilder().getTrue();
+      program.getMachine().generateIdleWait(waiting, blockgen);
+    }
+    const unsigned *jumpCycles = loopJumps.find(start);
+    if (jumpCycles) {
+      program.getMachine().generateInterruptPoll(*jumpCycles, blockgen);
+    }
     lastInstruction->generateCode(blockgen);
     start = lastInstruction->getFollowingLocation();
   }
@@ -138,47 +458,301 @@ void writeBlock(addr start, addr end, BlockGenerator &blockgen) {
   }
 }
 
-void writeFunction(addr start, ModuleGenerator &modgen) {
+// Rough cycle counts, only used to pace the interrupt scheduler.
+unsigned estimateCycles(const DecodedInstruction &inst) {
+  switch (inst.mode) {
+    case MODE_IMP:
+    case MODE_ACC:
+    case MODE_IMM:
+      return 2;
+    case MODE_ZPG:
+      return 3;
+    case MODE_IND:
+    case MODE_INDY:
+      return 5;
+    case MODE_INDX:
+      return 6;
+    default:
+      return 4;
+  }
+}
+
+unsigned estimateLoopCycles(addr target, addr end, const FunctionInfo &function, const Program &program) {
+  unsigned cycles = 0;
+  for (auto bodyAddress : function.instructions) {
+    if (bodyAddress >= target && bodyAddress <= end) {
+      cycles += estimateCycles(program.getInstruction(bodyAddress));
+    }
+  }
+  return cycles;
+}
+
+// Blocks entered by a backward edge, with roughly how many cycles a trip
+// around the loop takes. Pending interrupts are polled there, so native
+// code never needs a check per instruction.
+void findLoopHeaders(const FunctionInfo &function, const Program &program, AddrMap<unsigned> &out) {
+  for (auto instAddress : function.instructions) {
+    const DecodedInstruction &inst = program.getInstruction(instAddress);
+    if (!inst.isBranch()) {
+      continue;
+    }
+
+    addr target = inst.getBranchTarget();
+    if (target > instAddress || !function.blocks.count(target)) {
+      continue;
+    }
+    out[target] = std::max(out[target], estimateLoopCycles(target, instAddress, function, program));
+  }
+}
+
+// Absolute JMPs become tail calls, so the loops they close, like a main
+// loop or JMP * waiting for NMI, never come back to a header here. They
+// poll right before the backward jump instead; every cycle of tail calls
+// has at least one. Only a jump back into this function's own code is
+// known to close a loop over the instructions in between. A backward tail
+// call into another function pays for itself, and that function's own
+// jumps pay for the rest of any cycle it is part of.
+void findLoopJumps(const FunctionInfo &function, const Program &program, AddrMap<unsigned> &out) {
+  for (auto instAddress : function.instructions) {
+    const DecodedInstruction &inst = program.getInstruction(instAddress);
+    if (inst.opcode != OP_JMP || inst.mode != MODE_ABS || inst.operand > instAddress) {
+      continue;
+    }
+
+    if (function.instructions.count(inst.operand)) {
+      out[instAddress] = estimateLoopCycles(inst.operand, instAddress, function, program);
+    } else {
+      out[instAddress] = estimateCycles(inst);
+    }
+  }
+}
+
+// Instructions that only overwrite registers with what they read, so
+// running them again with the same memory changes nothing.
+bool isIdleInstruction(const DecodedInstruction &inst, const MachineSpec &machine) {
+  switch (inst.opcode) {
+    case OP_LDA:
+    case OP_LDX:
+    case OP_LDY:
+    case OP_BIT:
+    case OP_CMP:
+    case OP_CPX:
+    case OP_CPY:
+    case OP_AND:
+      break;
+    default:
+      return false;
+  }
+
+  switch (inst.mode) {
+    case MODE_IMM:
+      return true;
+    case MODE_ZPG:
+    case MODE_ABS:
+      return machine.isIdleRead(inst.operand);
+    default:
+      return false;
+  }
+}
+
+// Branches and absolute JMPs closing loops that only poll memory, like
+// waiting for vblank in $2002, for the NMI handler to set a flag, or just
+// JMP * until the next NMI. Nothing they read changes until the next
+// event, so the runtime can skip straight to it.
+void findIdleLoops(const FunctionInfo &function, const Program &program, AddrSet &out) {
+  for (auto instAddress : function.instructions) {
+    const DecodedInstruction &inst = program.getInstruction(instAddress);
+    addr target;
+    if (inst.isBranch()) {
+      target = inst.getBranchTarget();
+    } else if (inst.opcode == OP_JMP && inst.mode == MODE_ABS) {
+      target = inst.operand;
+    } else {
+      continue;
+    }
+
+    if (target > instAddress) {
+      continue;
+    }
+
+    addr address = target;
+    while (address < instAddress && function.instructions.count(address) &&
+        (address == target || !function.blocks.count(address))) {
+      const DecodedInstruction &body = program.getInstruction(address);
+      if (!isIdleInstruction(body, program.getMachine())) {
+        break;
+      }
+      address = body.getFollowingLocation();
+    }
+
+    if (address == instAddress) {
+      out.insert(instAddress);
+    }
+  }
+}
+
+const unsigned MIN_PROMOTED_ACCESSES = 2;
+
+// Zero-page words the function uses at constant addresses often enough to
+// be worth keeping in SSA values between calls.
+void findPromotableWords(const FunctionInfo &function, const Program &program, AddrSet &out) {
+  unsigned counts[ZERO_PAGE_END + 1] = {0};
+  for (auto instAddress : function.instructions) {
+    const DecodedInstruction &inst = program.getInstruction(instAddress);
+    if (inst.needsFallback() || inst.opcode == OP_JMP || inst.opcode == OP_JSR) {
+      continue;
+    }
+
+    switch (inst.mode) {
+      case MODE_ZPG:
+      case MODE_ABS:
+        if (inst.operand <= ZERO_PAGE_END) {
+          counts[inst.operand]++;
+        }
+        break;
+      case MODE_INDY:
+        counts[inst.operand]++;
+        counts[(word)(inst.operand + 1)]++;
+        break;
+      default:
+        break;
+    }
+  }
+
+  for (addr address = 0; address <= ZERO_PAGE_END; address++) {
+    if (counts[address] >= MIN_PROMOTED_ACCESSES) {
+      out.insert(address);
+    }
+  }
+}
+
+void writeFunction(addr start, const Program &program, ModuleGenerator &modgen) {
   char name[7];
   sprintf(name, "f_%04X", start);
 
   Function *func = modgen.getModule().getFunction(name);
 
-  set<addr> insts;
-  identifyFunction(start, modgen.getMachine(), insts);
+  const FunctionInfo &function = program.getFunction(start);
+  const AddrSet &insts = function.instructions;
+  const AddrSet &blocks = function.blocks;
+
+  BasicBlock *startBlock = BasicBlock::Create(modgen.getContext(), "start", func);
+
+  AddrSet promotable;
+  findPromotableWords(function, program, promotable);
 
-  set<addr> blocks;
-  identifyBlocks(start, insts, modgen.getMachine(), blocks);
+  AddrMap<unsigned> loopHeaders;
+  findLoopHeaders(function, program, loopHeaders);
 
-  BasicBlock *startBlock = BasicBlock::Create(getGlobalContext(), "start", func);
+  AddrMap<unsigned> loopJumps;
+  findLoopJumps(function, program, loopJumps);
 
-  map<addr, BlockGenerator *> blockMap;
-  for (auto &blockStart : blocks) {
+  AddrSet idleLoops;
+  findIdleLoops(function, program, idleLoops);
+
+  IRBuilder<> allocaBuilder(startBlock);
+  AddrMap<Value *> promotedWords;
+  for (auto address : promotable) {
+    char slotName[6];
+    sprintf(slotName, "zp_%02X", address);
+    promotedWords[address] = allocaBuilder.CreateAlloca(modgen.getWordType(), NULL, slotName);
+  }
+
+  AddrMap<BlockGenerator *> blockMap;
+  for (auto blockStart : blocks) {
     stringstream name;
     name << "l_" << std::hex << std::uppercase << std::setfill('0') << std::setw(4) << blockStart;
-    BasicBlock *block = BasicBlock::Create(getGlobalContext(), name.str(), func);
-    blockMap[blockStart] = new BlockGenerator(modgen, block, blockMap);
+    BasicBlock *block = BasicBlock::Create(modgen.getContext(), name.str(), func);
+    blockMap[blockStart] = new BlockGenerator(modgen, start, block, blockMap, promotedWords);
   }
 
+  BlockGenerator entry(modgen, start, startBlock, blockMap, promotedWords);
+  Function::arg_iterator arg = func->arg_begin();
+  if (modgen.isInstanced()) {
+    ++arg;
+  }
+  for (unsigned reg = 0; reg < REG_COUNT; reg++) {
+    Value *value;
+    if (function.signature.args & registerBit((Register)reg)) {
+      value = &*arg++;
+    } else {
+      value = UndefValue::get(modgen.getRegType((Register)reg));
+    }
+    entry.setRegValue((Register)reg, value);
+  }
+  entry.reloadPromotedWords();
+  entry.seal();
+  entry.generateJump(start);
+
   addr previous = 0;
-  for (auto &blockStart : blocks) {
+  for (auto blockStart : blocks) {
     if (previous != 0) {
-      writeBlock(previous, blockStart, *(blockMap[previous]));
+      writeBlock(previous, blockStart, loopHeaders[previous], loopJumps, idleLoops, program, *(blockMap[previous]));
     }
     previous = blockStart;
   }
 
   if (previous != 0) {
-    writeBlock(previous, *(insts.rbegin()) + 1, *(blockMap[previous]));
+    writeBlock(previous, insts.last() + 1, loopHeaders[previous], loopJumps, idleLoops, program, *(blockMap[previous]));
   }
 
-  Register argRegs[] = {REG_A, REG_X, REG_Y, REG_N, REG_V, REG_Z, REG_C};
+  // Every predecessor is known once all blocks are written, so phis are
+  // only completed here; ones that turned out trivial are left unused.
+  for (auto blockStart : blocks) {
+    blockMap[blockStart]->seal();
+  }
 
-  int i = 0;
-  for (auto &arg : func->args()) {
-    blockMap[start]->addIncomingValue(argRegs[i++], &arg, startBlock);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto blockStart : blocks) {
+      changed |= blockMap[blockStart]->removeDeadPhis();
+    }
+  }
+}
+
+void writeEntryThunk(addr start, const FunctionSignature &signature, bool instanced, Module &module) {
+  char name[7];
+  sprintf(name, "f_%04X", start);
+  char thunkName[7];
+  sprintf(thunkName, "e_%04X", start);
+
+  LLVMContext &context = module.getContext();
+  Function *func = module.getFunction(name);
+
+  Type *wordType = Type::getInt8Ty(context);
+  Type *flagType = Type::getInt1Ty(context);
+  Type *fieldTypes[] = {wordType, wordType, wordType, flagType, flagType, flagType, flagType};
+  StructType *regStructType = StructType::get(context, fieldTypes);
+
+  Type *args[] = {Type::getInt8PtrTy(context), PointerType::getUnqual(regStructType)};
+  FunctionType *ft = FunctionType::get(Type::getVoidTy(context), args, false);
+  Function *thunk = Function::Create(ft, Function::ExternalLinkage, thunkName, &module);
+
+  IRBuilder<> builder(BasicBlock::Create(context, "entry", thunk));
+  Function::arg_iterator thunkArg = thunk->arg_begin();
+  Value *machineState = &*thunkArg++;
+  Value *state = &*thunkArg;
+
+  vector<Value *> regs;
+  if (instanced) {
+    regs.push_back(machineState);
+  }
+  for (unsigned reg = 0; reg < REG_COUNT; reg++) {
+    if (signature.args & registerBit((Register)reg)) {
+      regs.push_back(builder.CreateLoad(builder.CreateStructGEP(state, reg)));
+    }
+  }
+
+  CallInst *call = builder.CreateCall(func, regs);
+  call->setCallingConv(func->getCallingConv());
+
+  unsigned field = 0;
+  for (unsigned reg = 0; reg < REG_COUNT; reg++) {
+    if (signature.rets & registerBit((Register)reg)) {
+      builder.CreateStore(builder.CreateExtractValue(call, field++), builder.CreateStructGEP(state, reg));
+    }
   }
 
-  IRBuilder<> builder(startBlock);
-  builder.CreateBr(blockMap[start]->getBlock());
+  builder.CreateRetVoid();
 }
@@ -1,14 +1,21 @@
 #pragma once
 
-#include <set>
-
+#include "addr_set.hpp"
 #include "memory.hpp"
+#include "registers.hpp"
+
+namespace llvm {
+  class Module;
+}
 
 class ModuleGenerator;
-class MachineSpec;
+class Program;
 
-void identifyFunction(addr start, const MachineSpec &machine, std::set<addr> &out);
-void identifyBlocks(addr start, const std::set<addr> &function, const MachineSpec &machine, std::set<addr> &out);
-void findReachableFunctions(addr start, const MachineSpec &machine, std::set<addr> &out);
-void declareFunction(addr start, bool external, ModuleGenerator &modgen);
-void writeFunction(addr start, ModuleGenerator &modgen);
+void identifyFunction(addr start, Program &program, AddrSet &out);
+void identifyBlocks(addr start, const AddrSet &function, Program &program, AddrSet &out);
+void findReachableFunctions(const AddrSet &roots, Program &program);
+void findReachableFunctions(addr start, Program &program);
+bool hasFallback(addr start, const Program &program);
+void declareFunction(addr start, const FunctionSignature &signature, bool external, ModuleGenerator &modgen);
+void writeFunction(addr start, const Program &program, ModuleGenerator &modgen);
+void writeEntryThunk(addr start, const FunctionSignature &signature, bool instanced, llvm::Module &module);
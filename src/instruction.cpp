@@ -12,760 +12,802 @@ using std::setw;
 #include <iostream>
 using std::ostream;
 
-#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/IRBuilder.h>
 using llvm::Value;
 using llvm::IRBuilder;
 using llvm::Type;
 using llvm::Function;
+using llvm::CallInst;
 using llvm::ArrayRef;
 using llvm::UndefValue;
+using llvm::Constant;
 using llvm::ConstantStruct;
+using llvm::ConstantInt;
+using llvm::ConstantPointerNull;
+using llvm::GlobalValue;
+using llvm::GlobalVariable;
+using llvm::BasicBlock;
+using llvm::PointerType;
+using llvm::StructType;
+using llvm::LLVMContext;
+using llvm::Module;
+using llvm::PHINode;
 
 #include "machine_spec.hpp"
 #include "codegen.hpp"
 
-#define DEF_NO_ARG_INST(OPCODE) class OPCODE : public NoArgInstruction { \
-  public: \
-    OPCODE(addr location) : NoArgInstruction(location, #OPCODE) {}
-
-#define DEF_WORD_ARG_INST(OPCODE) class OPCODE : public ArgInstruction { \
-  public: \
-    OPCODE(addr location, Argument *argument) : \
-      ArgInstruction(location, #OPCODE, argument) {}
-
-#define DEF_ADDR_ARG_INST(OPCODE) DEF_WORD_ARG_INST(OPCODE)
-
-#define DEF_BRANCH virtual bool isBranch() const { \
-  return true; \
-} \
-virtual addr getBranchTarget() const { \
-  return arg->getAddrArg(location + getEncodedLength()); \
-}
-
-ostream &operator<<(ostream &o, const Instruction &instruction) {
-  return instruction.write(o);
+#define INST(OPCODE, MODE) {OP_##OPCODE, MODE_##MODE}
+#define UNKNOWN {OP_UNKNOWN, MODE_IMP}
+
+extern constexpr OpcodeEntry OPCODE_TABLE[256] = {
+  // $00
+  INST(BRK, IMP), INST(ORA, INDX), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(ORA, ZPG), INST(ASL, ZPG), UNKNOWN,
+  INST(PHP, IMP), INST(ORA, IMM), INST(ASL, ACC), UNKNOWN,
+  UNKNOWN, INST(ORA, ABS), INST(ASL, ABS), UNKNOWN,
+  // $10
+  INST(BPL, REL), INST(ORA, INDY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(ORA, ZPGX), INST(ASL, ZPGX), UNKNOWN,
+  INST(CLC, IMP), INST(ORA, ABSY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(ORA, ABSX), INST(ASL, ABSX), UNKNOWN,
+  // $20
+  INST(JSR, ABS), INST(AND, INDX), UNKNOWN, UNKNOWN,
+  INST(BIT, ZPG), INST(AND, ZPG), INST(ROL, ZPG), UNKNOWN,
+  INST(PLP, IMP), INST(AND, IMM), INST(ROL, ACC), UNKNOWN,
+  INST(BIT, ABS), INST(AND, ABS), INST(ROL, ABS), UNKNOWN,
+  // $30
+  INST(BMI, REL), INST(AND, INDY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(AND, ZPGX), INST(ROL, ZPGX), UNKNOWN,
+  INST(SEC, IMP), INST(AND, ABSY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(AND, ABSX), INST(ROL, ABSX), UNKNOWN,
+  // $40
+  INST(RTI, IMP), INST(EOR, INDX), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(EOR, ZPG), INST(LSR, ZPG), UNKNOWN,
+  INST(PHA, IMP), INST(EOR, IMM), INST(LSR, ACC), UNKNOWN,
+  INST(JMP, ABS), INST(EOR, ABS), INST(LSR, ABS), UNKNOWN,
+  // $50
+  INST(BVC, REL), INST(EOR, INDY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(EOR, ZPGX), INST(LSR, ZPGX), UNKNOWN,
+  INST(CLI, IMP), INST(EOR, ABSY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(EOR, ABSX), INST(LSR, ABSX), UNKNOWN,
+  // $60
+  INST(RTS, IMP), INST(ADC, INDX), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(ADC, ZPG), INST(ROR, ZPG), UNKNOWN,
+  INST(PLA, IMP), INST(ADC, IMM), INST(ROR, ACC), UNKNOWN,
+  INST(JMP, IND), INST(ADC, ABS), INST(ROR, ABS), UNKNOWN,
+  // $70
+  INST(BVS, REL), INST(ADC, INDY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(ADC, ZPGX), INST(ROR, ZPGX), UNKNOWN,
+  INST(SEI, IMP), INST(ADC, ABSY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(ADC, ABSX), INST(ROR, ABSX), UNKNOWN,
+  // $80
+  UNKNOWN, INST(STA, INDX), UNKNOWN, UNKNOWN,
+  INST(STY, ZPG), INST(STA, ZPG), INST(STX, ZPG), UNKNOWN,
+  INST(DEY, IMP), UNKNOWN, INST(TXA, IMP), UNKNOWN,
+  INST(STY, ABS), INST(STA, ABS), INST(STX, ABS), UNKNOWN,
+  // $90
+  INST(BCC, REL), INST(STA, INDY), UNKNOWN, UNKNOWN,
+  INST(STY, ZPGX), INST(STA, ZPGX), INST(STX, ZPGY), UNKNOWN,
+  INST(TYA, IMP), INST(STA, ABSY), INST(TXS, IMP), UNKNOWN,
+  UNKNOWN, INST(STA, ABSX), UNKNOWN, UNKNOWN,
+  // $A0
+  INST(LDY, IMM), INST(LDA, INDX), INST(LDX, IMM), UNKNOWN,
+  INST(LDY, ZPG), INST(LDA, ZPG), INST(LDX, ZPG), UNKNOWN,
+  INST(TAY, IMP), INST(LDA, IMM), INST(TAX, IMP), UNKNOWN,
+  INST(LDY, ABS), INST(LDA, ABS), INST(LDX, ABS), UNKNOWN,
+  // $B0
+  INST(BCS, REL), INST(LDA, INDY), UNKNOWN, UNKNOWN,
+  INST(LDY, ZPGX), INST(LDA, ZPGX), INST(LDX, ZPGY), UNKNOWN,
+  INST(CLV, IMP), INST(LDA, ABSY), INST(TSX, IMP), UNKNOWN,
+  INST(LDY, ABSX), INST(LDA, ABSX), INST(LDX, ABSY), UNKNOWN,
+  // $C0
+  INST(CPY, IMM), INST(CMP, INDX), UNKNOWN, UNKNOWN,
+  INST(CPY, ZPG), INST(CMP, ZPG), INST(DEC, ZPG), UNKNOWN,
+  INST(INY, IMP), INST(CMP, IMM), INST(DEX, IMP), UNKNOWN,
+  INST(CPY, ABS), INST(CMP, ABS), INST(DEC, ABS), UNKNOWN,
+  // $D0
+  INST(BNE, REL), INST(CMP, INDY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(CMP, ZPGX), INST(DEC, ZPGX), UNKNOWN,
+  INST(CLD, IMP), INST(CMP, ABSY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(CMP, ABSX), INST(DEC, ABSX), UNKNOWN,
+  // $E0
+  INST(CPX, IMM), INST(SBC, INDX), UNKNOWN, UNKNOWN,
+  INST(CPX, ZPG), INST(SBC, ZPG), INST(INC, ZPG), UNKNOWN,
+  INST(INX, IMP), INST(SBC, IMM), INST(NOP, IMP), UNKNOWN,
+  INST(CPX, ABS), INST(SBC, ABS), INST(INC, ABS), UNKNOWN,
+  // $F0
+  INST(BEQ, REL), INST(SBC, INDY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(SBC, ZPGX), INST(INC, ZPGX), UNKNOWN,
+  INST(SED, IMP), INST(SBC, ABSY), UNKNOWN, UNKNOWN,
+  UNKNOWN, INST(SBC, ABSX), INST(INC, ABSX), UNKNOWN,
+
+};
+
+#undef INST
+#undef UNKNOWN
+
+extern constexpr word OPERAND_LENGTH[MODE_COUNT] = {
+  0, // MODE_IMP
+  0, // MODE_ACC
+  1, // MODE_IMM
+  1, // MODE_ZPG
+  1, // MODE_ZPGX
+  1, // MODE_ZPGY
+  2, // MODE_ABS
+  2, // MODE_ABSX
+  2, // MODE_ABSY
+  2, // MODE_IND
+  1, // MODE_INDX
+  1, // MODE_INDY
+  1  // MODE_REL
+};
+
+enum InstructionFlags {
+  INST_TERMINAL = 1,
+  INST_BRANCH = 2,
+  INST_CALL = 4,
+  INST_FALLBACK = 8
+};
+
+struct OpcodeInfo;
+
+typedef void (*CodeGenerator)(const DecodedInstruction &, const OpcodeInfo &, BlockGenerator &);
+
+struct OpcodeInfo {
+  const char *mnemonic;
+  unsigned flags;
+  CodeGenerator generate;
+  Register reg;
+  Register target;
+  bool inverse;
+};
+
+bool isAbsolute(const DecodedInstruction &inst) {
+  return inst.mode == MODE_ABS || inst.mode == MODE_ZPG;
 }
 
-class Argument {
-  public:
-    virtual ostream &write(ostream& o) const = 0;
-    virtual addr getEncodedLength() const = 0;
-    virtual addr getAddrArg(addr instructionAddr) const {
+addr getAddrArg(const DecodedInstruction &inst) {
+  switch(inst.mode) {
+    case MODE_ABS:
+    case MODE_ZPG:
+      return inst.operand;
+    case MODE_REL:
+      return inst.getFollowingLocation() + (int8_t)inst.operand;
+    default:
       return 0;
-    };
-    virtual Value *getWordArgExpr(addr instructionAddr, BlockGenerator &blockgen) const {
-      return blockgen.getConstant((word)0);
-    }
-    virtual Value *getAddrArgExpr(addr instructionAddr, BlockGenerator &blockgen) const {
-      return blockgen.getConstant((addr)0);
-    }
-    virtual bool isAbsolute() const {
-      return false;
-    }
-};
-
-ostream &operator<<(ostream &o, const Argument &mode) {
-  return mode.write(o);
+  }
 }
 
-class ABSArgument : public Argument {
-  public:
-    ABSArgument(addr address, const MachineSpec &machine) {
-      this->address = machine.readAddr(address);
-    }
-
-    ostream &write(ostream& o) const {
-      return o << "$" << hex << uppercase << setfill('0') << setw(4) << address;
-    }
-
-    addr getEncodedLength() const {
-      return 2;
-    }
-
-    virtual addr getAddrArg(addr instructionAddr) const {
-      return address;
-    }
-
-    virtual Value *getWordArgExpr(addr instructionAddr, BlockGenerator &blockgen) const {
-      return blockgen.getMachine().generateLoad(address, blockgen);
-    }
-
-    virtual bool isAbsolute() const {
-      return true;
-    }
-
-  private:
-    addr address;
-};
-
-class ABSXArgument : public Argument {
-  public:
-    ABSXArgument(addr address, const MachineSpec &machine) {
-      this->address = machine.readAddr(address);
-    }
-
-    ostream &write(ostream& o) const {
-      return o << "$" << hex << uppercase << setfill('0') << setw(4) << address << ",X";
-    }
-
-    addr getEncodedLength() const {
-      return 2;
-    }
-
-  private:
-    addr address;
-};
-
-class ABSYArgument : public Argument {
-  public:
-    ABSYArgument(addr address, const MachineSpec &machine) {
-      this->address = machine.readAddr(address);
-    }
-
-    ostream &write(ostream& o) const {
-      return o << "$" << hex << uppercase << setfill('0') << setw(4) << address << ",Y";
-    }
-
-    addr getEncodedLength() const {
-      return 2;
-    }
-
-    virtual Value *getAddrArgExpr(addr instructionAddr, BlockGenerator &blockgen) const {
-      Value *regVal = blockgen.getRegValue(REG_Y);
-      Value *regExt = blockgen.getBuilder().CreateZExt(regVal, blockgen.getAddrType());
-      Value *baseVal = blockgen.getConstant(address);
-      return blockgen.getBuilder().CreateAdd(baseVal, regExt);
-    }
-
-  private:
-    addr address;
-};
-
-class IMMArgument : public Argument {
-  public:
-    IMMArgument(addr address, const MachineSpec &machine) {
-      val = machine.readWord(address);
-    }
-
-    ostream &write(ostream& o) const {
-      return o << "#$" << hex << uppercase << setw(2) << (int)val;
-    }
-
-    addr getEncodedLength() const {
-      return 1;
-    }
-
-    virtual Value *getWordArgExpr(addr instructionAddr, BlockGenerator &blockgen) const {
-      return blockgen.getConstant(val);
-    }
-
-  private:
-    word val;
-};
-
-class INDYArgument : public Argument {
-  public:
-    INDYArgument(addr address, const MachineSpec &machine) {
-      this->base = machine.readAddr(address);
-    }
-
-    ostream &write(ostream& o) const {
-      return o << "($" << hex << uppercase << setfill('0') << setw(2) << (int)base << "),Y";
-    }
-
-    addr getEncodedLength() const {
-      return 1;
-    }
-
-    virtual Value *getAddrArgExpr(addr instructionAddr, BlockGenerator &blockgen) const {
-      Value *low = blockgen.getMachine().generateLoad(base, blockgen);
-      Value *high = blockgen.getMachine().generateLoad(base + 1, blockgen);
-      Value *lowext = blockgen.getBuilder().CreateZExt(low, blockgen.getAddrType());
-      Value *highext = blockgen.getBuilder().CreateZExt(high, blockgen.getAddrType());
-      Value *highsh = blockgen.getBuilder().CreateShl(highext, blockgen.getConstant((addr)8));
-      Value *baseAddr = blockgen.getBuilder().CreateAdd(lowext, highsh);
-      Value *regOffset = blockgen.getBuilder().CreateZExt(blockgen.getRegValue(REG_Y), blockgen.getAddrType());
-      return blockgen.getBuilder().CreateAdd(baseAddr, regOffset);
-    }
-
-  private:
-    word base;
-};
-
-class RELArgument : public Argument {
-  public:
-    RELArgument(addr address, const MachineSpec &machine) {
-      offset = machine.readWord(address);
-    }
-
-    ostream &write(ostream& o) const {
-      return o << "$" << hex << uppercase << setw(2) << (int)offset;
-    }
-
-    addr getEncodedLength() const {
-      return 1;
-    }
-
-    virtual addr getAddrArg(addr instructionAddr) const {
-      return instructionAddr + (*((int8_t *)&offset));
-    }
-
-  private:
-    word offset;
-};
-
-class ZPGArgument : public Argument {
-  public:
-    ZPGArgument(addr address, const MachineSpec &machine) {
-      this->address = machine.readWord(address);
-    }
-
-    ostream &write(ostream& o) const {
-      return o << "$" << hex << uppercase << setw(2) << (int)address;
-    }
-
-    addr getEncodedLength() const {
-      return 1;
-    }
-
-    virtual addr getAddrArg(addr instructionAddr) const {
-      return address;
-    }
-
-    virtual bool isAbsolute() const {
-      return true;
-    }
-
-  private:
-    word address;
-};
-
-class NoArgInstruction : public Instruction {
-  public:
-    NoArgInstruction(addr location, const char *opcode) : Instruction(location, opcode) {}
-
-    ostream &write(ostream& o) const {
-      return o << hex << uppercase << setfill('0') << setw(4) << location << ": " << opcode;
-    }
-
-    addr getEncodedLength() const {
-      return 1;
-    }
-};
-
-class ArgInstruction : public Instruction {
-  public:
-    ArgInstruction(addr location, const char *opcode, Argument *arg) : 
-      Instruction (location, opcode), 
-      arg (arg) {}
-
-    virtual ~ArgInstruction() {
-      delete arg;
-    }
-
-    addr getEncodedLength() const {
-      return 1 + arg->getEncodedLength();
-    }
-
-    ostream &write(ostream& o) const {
-      return o << hex << uppercase << setfill('0') << setw(4) << location << ": " << opcode << " " << *arg;
-    }
-
-  protected:
-    const Argument *arg;
-};
-
-Instruction::Instruction(addr location, const char *opcode) : 
-  location(location),
-  opcode (opcode)
-{}
-
-bool Instruction::isTerminal() const {
-  return false;
+Value *loadWord(addr address, BlockGenerator &blockgen) {
+  Value *slot = blockgen.getPromotedWord(address);
+  if (slot) {
+    return blockgen.getBuilder().CreateLoad(slot);
+  }
+  return blockgen.getMachine().generateLoad(address, blockgen);
 }
 
-bool Instruction::isBranch() const {
-  return false;
+void storeWord(addr address, Value *value, BlockGenerator &blockgen) {
+  Value *slot = blockgen.getPromotedWord(address);
+  if (slot) {
+    blockgen.getBuilder().CreateStore(value, slot);
+  } else {
+    blockgen.getMachine().generateStore(address, value, blockgen);
+  }
 }
 
-addr Instruction::getBranchTarget() const {
-  return 0;
+Value *getIndexedAddrExpr(addr base, Register reg, BlockGenerator &blockgen) {
+  Value *regVal = blockgen.getRegValue(reg);
+  Value *regExt = blockgen.getBuilder().CreateZExt(regVal, blockgen.getAddrType());
+  Value *baseVal = blockgen.getConstant(base);
+  return blockgen.getBuilder().CreateAdd(baseVal, regExt);
 }
 
-bool Instruction::isCall() const {
-  return false;
+Value *getZeroPageIndexedExpr(word base, Register reg, BlockGenerator &blockgen) {
+  Value *sum = blockgen.getBuilder().CreateAdd(blockgen.getConstant(base), blockgen.getRegValue(reg));
+  return blockgen.getBuilder().CreateZExt(sum, blockgen.getAddrType());
 }
 
-addr Instruction::getCallTarget() const {
-  return 0;
+Value *combineAddrExpr(Value *low, Value *high, BlockGenerator &blockgen) {
+  Value *lowext = blockgen.getBuilder().CreateZExt(low, blockgen.getAddrType());
+  Value *highext = blockgen.getBuilder().CreateZExt(high, blockgen.getAddrType());
+  Value *highsh = blockgen.getBuilder().CreateShl(highext, blockgen.getConstant((addr)8));
+  return blockgen.getBuilder().CreateAdd(lowext, highsh);
 }
 
-addr Instruction::getFollowingLocation() const {
-  return location + getEncodedLength();
+Value *getAddrArgExpr(const DecodedInstruction &inst, BlockGenerator &blockgen) {
+  switch(inst.mode) {
+    case MODE_ABS:
+    case MODE_ZPG:
+      return blockgen.getConstant(inst.operand);
+    case MODE_ZPGX:
+      return getZeroPageIndexedExpr(inst.operand, REG_X, blockgen);
+    case MODE_ZPGY:
+      return getZeroPageIndexedExpr(inst.operand, REG_Y, blockgen);
+    case MODE_ABSX:
+      return getIndexedAddrExpr(inst.operand, REG_X, blockgen);
+    case MODE_ABSY:
+      return getIndexedAddrExpr(inst.operand, REG_Y, blockgen);
+    case MODE_INDX: {
+      Value *lowPtr = blockgen.getBuilder().CreateAdd(blockgen.getConstant((word)inst.operand), blockgen.getRegValue(REG_X));
+      Value *highPtr = blockgen.getBuilder().CreateAdd(lowPtr, blockgen.getConstant((word)1));
+      Value *low = blockgen.getMachine().generateLoad(blockgen.getBuilder().CreateZExt(lowPtr, blockgen.getAddrType()), blockgen);
+      Value *high = blockgen.getMachine().generateLoad(blockgen.getBuilder().CreateZExt(highPtr, blockgen.getAddrType()), blockgen);
+      return combineAddrExpr(low, high, blockgen);
+    }
+    case MODE_INDY: {
+      word base = inst.operand;
+      Value *low = loadWord(base, blockgen);
+      Value *high = loadWord((word)(base + 1), blockgen);
+      Value *baseAddr = combineAddrExpr(low, high, blockgen);
+      Value *regOffset = blockgen.getBuilder().CreateZExt(blockgen.getRegValue(REG_Y), blockgen.getAddrType());
+      return blockgen.getBuilder().CreateAdd(baseAddr, regOffset);
+    }
+    default:
+      return blockgen.getConstant((addr)0);
+  }
 }
 
-void Instruction::generateCode(BlockGenerator &codegen) const { }
-
-void setRegN(Value *val, BlockGenerator &blockgen) {
-  Value *zero = blockgen.getConstant((word)0);
-  Value *n = blockgen.getBuilder().CreateICmpSLT(val, zero);
-  blockgen.setRegValue(REG_N, n);
+Value *getWordArgExpr(const DecodedInstruction &inst, BlockGenerator &blockgen) {
+  switch(inst.mode) {
+    case MODE_ACC:
+      return blockgen.getRegValue(REG_A);
+    case MODE_IMM:
+      return blockgen.getConstant((word)inst.operand);
+    case MODE_ABS:
+    case MODE_ZPG:
+      return loadWord(inst.operand, blockgen);
+    case MODE_ABSX:
+    case MODE_ABSY: {
+      Register reg = inst.mode == MODE_ABSX ? REG_X : REG_Y;
+      Value *index = blockgen.getBuilder().CreateZExt(blockgen.getRegValue(reg), blockgen.getAddrType());
+      return blockgen.getMachine().generateIndexedLoad(inst.operand, index, blockgen);
+    }
+    case MODE_ZPGX:
+    case MODE_ZPGY:
+    case MODE_INDX:
+    case MODE_INDY:
+      return blockgen.getMachine().generateLoad(getAddrArgExpr(inst, blockgen), blockgen);
+    default:
+      return blockgen.getConstant((word)0);
+  }
 }
 
-void setRegZ(Value *val, BlockGenerator &blockgen) {
-  Value *zero = blockgen.getConstant((word)0);
-  Value *z = blockgen.getBuilder().CreateICmpEQ(val, zero);
-  blockgen.setRegValue(REG_Z, z);
+void writeWordArg(const DecodedInstruction &inst, Value *value, BlockGenerator &blockgen) {
+  if (inst.mode == MODE_ACC) {
+    blockgen.setRegValue(REG_A, value);
+  } else if (isAbsolute(inst)) {
+    storeWord(getAddrArg(inst), value, blockgen);
+  } else {
+    blockgen.getMachine().generateStore(getAddrArgExpr(inst, blockgen), value, blockgen);
+  }
 }
 
-void writeCall(addr target, BlockGenerator &blockgen) {
+void writeRet(BlockGenerator &blockgen);
+void writePendingJumps(BlockGenerator &blockgen);
+
+CallInst *createFunctionCall(addr target, BlockGenerator &blockgen) {
   char targetName[7];
   sprintf(targetName, "f_%04X", target);
 
-  Value *args[] = {
-    blockgen.getRegValue(REG_A),
-    blockgen.getRegValue(REG_X),
-    blockgen.getRegValue(REG_Y),
-    blockgen.getRegValue(REG_N),
-    blockgen.getRegValue(REG_V),
-    blockgen.getRegValue(REG_Z),
-    blockgen.getRegValue(REG_C),
-  };
+  const FunctionSignature &signature = blockgen.getSignature(target);
+  vector<Value *> args;
+  if (blockgen.isInstanced()) {
+    args.push_back(blockgen.getStatePointer());
+  }
+  for (unsigned reg = 0; reg < REG_COUNT; reg++) {
+    if (signature.args & registerBit((Register)reg)) {
+      args.push_back(blockgen.getRegValue((Register)reg));
+    }
+  }
 
   Function *func = blockgen.getModule().getFunction(targetName);
-  Value *s = blockgen.getBuilder().CreateCall(func, ArrayRef<Value *>(args, 7));
-
-  IRBuilder<> &builder = blockgen.getBuilder();
-  blockgen.setRegValue(REG_A, builder.CreateExtractValue(s, ArrayRef<unsigned>(0)));
-  blockgen.setRegValue(REG_X, builder.CreateExtractValue(s, ArrayRef<unsigned>(1)));
-  blockgen.setRegValue(REG_Y, builder.CreateExtractValue(s, ArrayRef<unsigned>(2)));
-  blockgen.setRegValue(REG_N, builder.CreateExtractValue(s, ArrayRef<unsigned>(3)));
-  blockgen.setRegValue(REG_V, builder.CreateExtractValue(s, ArrayRef<unsigned>(4)));
-  blockgen.setRegValue(REG_Z, builder.CreateExtractValue(s, ArrayRef<unsigned>(5)));
-  blockgen.setRegValue(REG_C, builder.CreateExtractValue(s, ArrayRef<unsigned>(6)));
-}
-
-void writeRet(BlockGenerator &blockgen) {
-  Value *undefWord = UndefValue::get(blockgen.getWordType());
-  Value *undefFlag = UndefValue::get(blockgen.getFlagType());
-  Value *s = ConstantStruct::get(blockgen.getRegStructType(), undefWord, undefWord, undefWord, undefFlag, undefFlag, undefFlag, undefFlag, NULL);
-  IRBuilder<> &builder = blockgen.getBuilder();
-
-  s = builder.CreateInsertValue(s, blockgen.getRegValue(REG_A), ArrayRef<unsigned>(0));
-  s = builder.CreateInsertValue(s, blockgen.getRegValue(REG_X), ArrayRef<unsigned>(1));
-  s = builder.CreateInsertValue(s, blockgen.getRegValue(REG_Y), ArrayRef<unsigned>(2));
-  s = builder.CreateInsertValue(s, blockgen.getRegValue(REG_N), ArrayRef<unsigned>(3));
-  s = builder.CreateInsertValue(s, blockgen.getRegValue(REG_V), ArrayRef<unsigned>(4));
-  s = builder.CreateInsertValue(s, blockgen.getRegValue(REG_Z), ArrayRef<unsigned>(5));
-  s = builder.CreateInsertValue(s, blockgen.getRegValue(REG_C), ArrayRef<unsigned>(6));
-
-  builder.CreateRet(s);
+  CallInst *call = blockgen.getBuilder().CreateCall(func, args);
+  call->setCallingConv(func->getCallingConv());
+  return call;
 }
 
-class LoadInstruction : public ArgInstruction {
-  public:
-    LoadInstruction(const char *opcode, Register reg, addr location, Argument *argument) :
-    ArgInstruction(location, opcode, argument),
-    reg(reg) { }
+void writeCall(addr target, BlockGenerator &blockgen) {
+  blockgen.spillPromotedWords();
+  Value *s = createFunctionCall(target, blockgen);
+  blockgen.reloadPromotedWords();
+  const FunctionSignature &signature = blockgen.getSignature(target);
 
-    virtual void generateCode(BlockGenerator &blockgen) const {
-      Value *val = arg->getWordArgExpr(location, blockgen);
-      blockgen.setRegValue(reg, val);
-      setRegN(val, blockgen);
-      setRegZ(val, blockgen);
+  unsigned field = 0;
+  for (unsigned reg = 0; reg < REG_COUNT; reg++) {
+    if (signature.rets & registerBit((Register)reg)) {
+      blockgen.setRegValue((Register)reg, blockgen.getBuilder().CreateExtractValue(s, field++));
     }
+  }
 
-  private:
-    Register reg;
-};
+  // Only functions that return every register can end in an indirect jump.
+  if (signature.rets == ALL_REGISTERS) {
+    writePendingJumps(blockgen);
+  }
+}
 
-class LDA : public LoadInstruction {
-  public:
-    LDA(addr location, Argument *argument) :
-    LoadInstruction("LDA", REG_A, location, argument){ }
-};
+void writeTailCall(addr target, BlockGenerator &blockgen) {
+  if (blockgen.getSignature(target) != blockgen.getSignature(blockgen.getFunction())) {
+    writeCall(target, blockgen);
+    writeRet(blockgen);
+    return;
+  }
 
-class LDX : public LoadInstruction {
-  public:
-    LDX(addr location, Argument *argument) :
-    LoadInstruction("LDX", REG_X, location, argument){ }
-};
+  blockgen.spillPromotedWords();
+  CallInst *call = createFunctionCall(target, blockgen);
+  call->setTailCallKind(CallInst::TCK_MustTail);
+  blockgen.getBuilder().CreateRet(call);
+}
 
-class LDY : public LoadInstruction {
-  public:
-    LDY(addr location, Argument *argument) :
-    LoadInstruction("LDY", REG_Y, location, argument){ }
-};
+Value *spillRegisters(BlockGenerator &blockgen) {
+  Register regs[] = {REG_A, REG_X, REG_Y, REG_N, REG_V, REG_Z, REG_C};
+  IRBuilder<> &builder = blockgen.getBuilder();
 
-class StoreInstruction : public ArgInstruction {
-  public:
-    StoreInstruction(const char *opcode, Register reg, addr location, Argument *argument) :
-    ArgInstruction(location, opcode, argument),
-    reg(reg) { }
-
-    virtual void generateCode(BlockGenerator &blockgen) const {
-      // TODO
-      if (arg->isAbsolute()) {
-        blockgen.getMachine().generateStore(arg->getAddrArg(location), blockgen.getRegValue(reg), blockgen);
-      } else {
-        blockgen.getMachine().generateStore(arg->getAddrArgExpr(location, blockgen), blockgen.getRegValue(reg), blockgen);
-      }
-    }
+  BasicBlock &entryBlock = builder.GetInsertBlock()->getParent()->getEntryBlock();
+  IRBuilder<> allocaBuilder(&entryBlock, entryBlock.begin());
+  Value *state = allocaBuilder.CreateAlloca(blockgen.getRegStructType());
+  for (unsigned i = 0; i < 7; i++) {
+    builder.CreateStore(blockgen.getRegValue(regs[i]), builder.CreateStructGEP(state, i));
+  }
+  return state;
+}
 
-  private:
-    Register reg;
-};
+void reloadRegisters(Value *state, BlockGenerator &blockgen) {
+  Register regs[] = {REG_A, REG_X, REG_Y, REG_N, REG_V, REG_Z, REG_C};
+  IRBuilder<> &builder = blockgen.getBuilder();
 
-class STA : public StoreInstruction {
-  public:
-    STA(addr location, Argument *argument) :
-    StoreInstruction("STA", REG_A, location, argument){ }
-};
+  for (unsigned i = 0; i < 7; i++) {
+    blockgen.setRegValue(regs[i], builder.CreateLoad(builder.CreateStructGEP(state, i)));
+  }
+}
 
-class STX : public StoreInstruction {
-  public:
-    STX(addr location, Argument *argument) :
-    StoreInstruction("STX", REG_X, location, argument){ }
-};
+// Indirect jumps return to their caller with the target's entry pending
+// instead of calling it, so that chains of them run in constant stack.
+// Every call site runs whatever its callee left pending.
+void writePendingJumps(BlockGenerator &blockgen) {
+  Register regs[] = {REG_A, REG_X, REG_Y, REG_N, REG_V, REG_Z, REG_C};
+  IRBuilder<> &builder = blockgen.getBuilder();
+  LLVMContext &context = blockgen.getContext();
+  Function *func = builder.GetInsertBlock()->getParent();
 
-class STY : public StoreInstruction {
-  public:
-    STY(addr location, Argument *argument) :
-    StoreInstruction("STY", REG_Y, location, argument){ }
-};
+  Value *values[7];
+  for (unsigned i = 0; i < 7; i++) {
+    values[i] = blockgen.getRegValue(regs[i]);
+  }
 
-class CompareInstruction : public ArgInstruction {
-  public:
-    CompareInstruction(const char *opcode, Register reg, addr location, Argument *argument) :
-    ArgInstruction(location, opcode, argument),
-    reg(reg) { }
+  BasicBlock *callBlock = builder.GetInsertBlock();
+  BasicBlock *pendingBlock = BasicBlock::Create(context, "pending", func);
+  BasicBlock *doneBlock = BasicBlock::Create(context, "pending_done", func);
+
+  Value *pending = builder.CreateLoad(blockgen.getMachine().getPendingEntryPtr(blockgen));
+  builder.CreateCondBr(builder.CreateIsNotNull(pending), pendingBlock, doneBlock);
+
+  builder.SetInsertPoint(pendingBlock);
+  Value *state = spillRegisters(blockgen);
+  blockgen.spillPromotedWords();
+  blockgen.createHookCall("trampoline", state);
+  blockgen.reloadPromotedWords();
+  reloadRegisters(state, blockgen);
+  pendingBlock = builder.GetInsertBlock();
+  builder.CreateBr(doneBlock);
+
+  builder.SetInsertPoint(doneBlock);
+  for (unsigned i = 0; i < 7; i++) {
+    PHINode *phi = builder.CreatePHI(values[i]->getType(), 2);
+    phi->addIncoming(values[i], callBlock);
+    phi->addIncoming(blockgen.getRegValue(regs[i]), pendingBlock);
+    blockgen.setRegValue(regs[i], phi);
+  }
+}
 
-    virtual void generateCode(BlockGenerator &blockgen) const {
-      Value *argVal = arg->getWordArgExpr(location, blockgen);
+void writeFallback(addr location, BlockGenerator &blockgen) {
+  Value *state = spillRegisters(blockgen);
+  blockgen.spillPromotedWords();
 
-      Value *regVal = blockgen.getRegValue(reg);
-      vector<Type *> argType;
-      argType.push_back(blockgen.getWordType());
-      Function *sub = llvm::Intrinsic::getDeclaration(&blockgen.getModule(), llvm::Intrinsic::ssub_with_overflow, argType);
+  Value *args[] = {blockgen.getConstant(location), state};
+  blockgen.createHookCall("interpret", ArrayRef<Value *>(args, 2));
 
-      Value *args[2] = {regVal, argVal};
-      Value *tmp = blockgen.getBuilder().CreateCall(sub, ArrayRef<Value *>(args, 2));
+  blockgen.reloadPromotedWords();
+  reloadRegisters(state, blockgen);
+  writeRet(blockgen);
+}
 
-      unsigned int first[1] = {0};
-      Value *difference = blockgen.getBuilder().CreateExtractValue(tmp, ArrayRef<unsigned int>(first, 1));
+Value *getIndirectTarget(const DecodedInstruction &inst, BlockGenerator &blockgen) {
+  IRBuilder<> &builder = blockgen.getBuilder();
 
-      unsigned int second[1] = {1};
-      Value *carry = blockgen.getBuilder().CreateExtractValue(tmp, ArrayRef<unsigned int>(second, 1));
+  addr highAddr = (inst.operand & 0xFF00) | ((inst.operand + 1) & 0x00FF);
+  Value *low = builder.CreateZExt(loadWord(inst.operand, blockgen), blockgen.getAddrType());
+  Value *high = builder.CreateZExt(loadWord(highAddr, blockgen), blockgen.getAddrType());
+  return builder.CreateOr(low, builder.CreateShl(high, 8));
+}
 
-      setRegN(difference, blockgen);
-      setRegZ(difference, blockgen);
-      blockgen.setRegValue(REG_C, carry);
-    }
+// Native targets are left pending for the caller's trampoline, while
+// dispatch() has already run targets without native code.
+void writeIndirectReturn(Value *entry, Value *state, BlockGenerator &blockgen) {
+  IRBuilder<> &builder = blockgen.getBuilder();
+  Function *func = builder.GetInsertBlock()->getParent();
 
-  private:
-    Register reg;
-};
+  BasicBlock *nativeBlock = BasicBlock::Create(blockgen.getContext(), "jump_native", func);
+  BasicBlock *interpretedBlock = BasicBlock::Create(blockgen.getContext(), "jump_interpreted", func);
+  builder.CreateCondBr(builder.CreateIsNotNull(entry), nativeBlock, interpretedBlock);
 
-class CMP : public CompareInstruction {
-  public:
-    CMP(addr location, Argument *argument) :
-    CompareInstruction("CMP", REG_A, location, argument){ }
-};
+  builder.SetInsertPoint(nativeBlock);
+  builder.CreateStore(entry, blockgen.getMachine().getPendingEntryPtr(blockgen));
+  writeRet(blockgen);
 
-class CPX : public CompareInstruction {
-  public:
-    CPX(addr location, Argument *argument) :
-    CompareInstruction("CPX", REG_X, location, argument){ }
-};
+  builder.SetInsertPoint(interpretedBlock);
+  blockgen.reloadPromotedWords();
+  reloadRegisters(state, blockgen);
+  writeRet(blockgen);
+}
 
-class CPY : public CompareInstruction {
-  public:
-    CPY(addr location, Argument *argument) :
-    CompareInstruction("CPY", REG_Y, location, argument){ }
-};
+void writeIndirectJump(const DecodedInstruction &inst, BlockGenerator &blockgen) {
+  IRBuilder<> &builder = blockgen.getBuilder();
+  LLVMContext &context = blockgen.getContext();
+  Module &module = blockgen.getModule();
+  Function *func = builder.GetInsertBlock()->getParent();
+
+  Value *target = getIndirectTarget(inst, blockgen);
+  Value *state = spillRegisters(blockgen);
+  blockgen.spillPromotedWords();
+
+  // The inline cache is shared by every instance, and its two fields can't
+  // be updated atomically, so instanced code always asks the runtime.
+  Value *args[] = {target, state};
+  if (blockgen.isInstanced()) {
+    writeIndirectReturn(blockgen.createHookCall("dispatch", ArrayRef<Value *>(args, 2)), state, blockgen);
+    return;
+  }
 
-class BranchInstruction : public ArgInstruction {
-  public:
-    BranchInstruction(const char *opcode, Register reg, bool inverse, addr location, Argument *argument) :
-    ArgInstruction(location, opcode, argument),
-    reg(reg),
-    inverse(inverse){ }
+  Function *dispatch = module.getFunction("dispatch");
+  PointerType *entryType = llvm::cast<PointerType>(dispatch->getReturnType());
+  Type *keyType = Type::getInt32Ty(context);
+  Type *fields[] = {keyType, entryType};
+  StructType *cacheType = StructType::get(context, fields);
+  Constant *noKey = ConstantInt::get(keyType, 0xFFFFFFFF);
+
+  char name[8];
+  sprintf(name, "ic_%04X", inst.location);
+  GlobalVariable *cache = new GlobalVariable(module, cacheType, false, GlobalValue::PrivateLinkage,
+    ConstantStruct::get(cacheType, noKey, ConstantPointerNull::get(entryType), NULL), name);
+
+  BasicBlock *hitBlock = BasicBlock::Create(context, "ic_hit", func);
+  BasicBlock *missBlock = BasicBlock::Create(context, "ic_miss", func);
+  BasicBlock *doneBlock = BasicBlock::Create(context, "ic_done", func);
+
+  Value *key = builder.CreateZExt(target, keyType);
+  Value *cachedKey = builder.CreateLoad(builder.CreateStructGEP(cache, 0));
+  builder.CreateCondBr(builder.CreateICmpEQ(key, cachedKey), hitBlock, missBlock);
+
+  builder.SetInsertPoint(hitBlock);
+  Value *cachedEntry = builder.CreateLoad(builder.CreateStructGEP(cache, 1));
+  builder.CreateBr(doneBlock);
+
+  builder.SetInsertPoint(missBlock);
+  Value *entry = builder.CreateCall(dispatch, ArrayRef<Value *>(args, 2));
+  Value *isNative = builder.CreateIsNotNull(entry);
+  builder.CreateStore(builder.CreateSelect(isNative, key, noKey), builder.CreateStructGEP(cache, 0));
+  builder.CreateStore(entry, builder.CreateStructGEP(cache, 1));
+  builder.CreateBr(doneBlock);
+
+  builder.SetInsertPoint(doneBlock);
+  PHINode *nextEntry = builder.CreatePHI(entryType, 2);
+  nextEntry->addIncoming(cachedEntry, hitBlock);
+  nextEntry->addIncoming(entry, missBlock);
+  writeIndirectReturn(nextEntry, state, blockgen);
+}
 
-    virtual bool isBranch() const {
-      return true;
-    }
+void writeRet(BlockGenerator &blockgen) {
+  const FunctionSignature &signature = blockgen.getSignature(blockgen.getFunction());
+  IRBuilder<> &builder = blockgen.getBuilder();
+  blockgen.spillPromotedWords();
 
-    virtual addr getBranchTarget() const {
-      return arg->getAddrArg(location + getEncodedLength());
+  Value *s = UndefValue::get(blockgen.getReturnType(signature.rets));
+  unsigned field = 0;
+  for (unsigned reg = 0; reg < REG_COUNT; reg++) {
+    if (signature.rets & registerBit((Register)reg)) {
+      s = builder.CreateInsertValue(s, blockgen.getRegValue((Register)reg), field++);
     }
+  }
 
-    virtual void generateCode(BlockGenerator &blockgen) const {
-      Value *condition = blockgen.getRegValue(reg);
-      addr trueBlock;
-      addr falseBlock;
-      if (inverse) {
-        trueBlock = getFollowingLocation();
-        falseBlock = getBranchTarget();
-      } else {
-        trueBlock = getBranchTarget();
-        falseBlock = getFollowingLocation();
-      }
-      blockgen.generateConditionalJump(condition, trueBlock, falseBlock);
-    }
+  builder.CreateRet(s);
+}
 
-  private:
-    Register reg;
-    bool inverse;
-};
+void generateNothing(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) { }
 
-class BCS : public BranchInstruction {
-  public:
-    BCS(addr location, Argument *argument) :
-    BranchInstruction("BCS", REG_C, false, location, argument){ }
-};
+void generateRegisterLoad(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  Value *val = getWordArgExpr(inst, blockgen);
+  blockgen.setRegValue(info.reg, val);
+  blockgen.setResultFlags(val);
+}
 
-class BNE : public BranchInstruction {
-  public:
-    BNE(addr location, Argument *argument) :
-    BranchInstruction("BNE", REG_Z, true, location, argument){ }
-};
+void generateRegisterStore(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  writeWordArg(inst, blockgen.getRegValue(info.reg), blockgen);
+}
 
-class BPL : public BranchInstruction {
-  public:
-    BPL(addr location, Argument *argument) :
-    BranchInstruction("BPL", REG_N, true, location, argument){ }
-};
+void generateCompare(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  Value *argVal = getWordArgExpr(inst, blockgen);
+  Value *regVal = blockgen.getRegValue(info.reg);
 
-class IncrementInstruction : public NoArgInstruction {
-  public:
-    IncrementInstruction(const char *opcode, Register reg, bool decrement, addr location) :
-    NoArgInstruction(location, opcode),
-    reg(reg),
-    decrement(decrement){ }
-
-    virtual void generateCode(BlockGenerator &blockgen) const {
-      Value *lhs = blockgen.getRegValue(reg);
-      Value *rhs = blockgen.getConstant((word)1);
-
-      Value *value;
-      if (decrement) {
-        value = blockgen.getBuilder().CreateSub(lhs, rhs);
-      } else {
-        value = blockgen.getBuilder().CreateAdd(lhs, rhs);
-      }
-
-      blockgen.setRegValue(reg, value);
-      setRegN(value, blockgen);
-      setRegZ(value, blockgen);
-    }
+  blockgen.setResultFlags(blockgen.getBuilder().CreateSub(regVal, argVal));
+  blockgen.setLazyFlag(REG_C, FLAG_UNSIGNED_GE, regVal, argVal);
+}
 
-  private:
-    Register reg;
-    bool decrement;
-};
+void generateBranch(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  Value *condition = blockgen.getRegValue(info.reg);
+  addr trueBlock;
+  addr falseBlock;
+  if (info.inverse) {
+    trueBlock = inst.getFollowingLocation();
+    falseBlock = inst.getBranchTarget();
+  } else {
+    trueBlock = inst.getBranchTarget();
+    falseBlock = inst.getFollowingLocation();
+  }
+  blockgen.generateConditionalJump(condition, trueBlock, falseBlock);
+}
 
-class INX : public IncrementInstruction {
-  public:
-    INX(addr location) :
-    IncrementInstruction("INX", REG_X, false, location){ }
-};
+void generateIncrement(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  Value *lhs = blockgen.getRegValue(info.reg);
+  Value *rhs = blockgen.getConstant((word)1);
 
-class INY : public IncrementInstruction {
-  public:
-    INY(addr location) :
-    IncrementInstruction("INY", REG_Y, false, location){ }
-};
+  Value *value;
+  if (info.inverse) {
+    value = blockgen.getBuilder().CreateSub(lhs, rhs);
+  } else {
+    value = blockgen.getBuilder().CreateAdd(lhs, rhs);
+  }
 
-class DEX : public IncrementInstruction {
-  public:
-    DEX(addr location) :
-    IncrementInstruction("DEX", REG_X, true, location){ }
-};
+  blockgen.setRegValue(info.reg, value);
+  blockgen.setResultFlags(value);
+}
 
-class DEY : public IncrementInstruction {
-  public:
-    DEY(addr location) :
-    IncrementInstruction("DEY", REG_Y, true, location){ }
-};
+void generateTransfer(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  Value *srcVal = blockgen.getRegValue(info.reg);
+  blockgen.setRegValue(info.target, srcVal);
+  blockgen.setResultFlags(srcVal);
+}
 
-class TransferInstruction : public NoArgInstruction {
-  public:
-    TransferInstruction(const char *opcode, Register src, Register dest, addr location) :
-    NoArgInstruction(location, opcode),
-    src(src),
-    dest(dest)
-    { }
-
-    virtual void generateCode(BlockGenerator &blockgen) const {
-      Value *srcVal = blockgen.getRegValue(src);
-      blockgen.setRegValue(dest, srcVal);
-      setRegN(srcVal, blockgen);
-      setRegZ(srcVal, blockgen);
-    }
+void generateLogic(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  Value *lhs = blockgen.getRegValue(REG_A);
+  Value *rhs = getWordArgExpr(inst, blockgen);
+
+  Value *value;
+  switch (inst.opcode) {
+    case OP_AND:
+      value = blockgen.getBuilder().CreateAnd(lhs, rhs);
+      break;
+    case OP_ORA:
+      value = blockgen.getBuilder().CreateOr(lhs, rhs);
+      break;
+    default:
+      value = blockgen.getBuilder().CreateXor(lhs, rhs);
+  }
 
-  private:
-    Register src;
-    Register dest;
-};
+  blockgen.setRegValue(REG_A, value);
+  blockgen.setResultFlags(value);
+}
 
-class TXA : public TransferInstruction {
-  public:
-    TXA(addr location) :
-    TransferInstruction("TXA", REG_X, REG_A, location){ }
-};
+void generateMemoryIncrement(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  const MachineSpec &machine = blockgen.getMachine();
+  Value *address = isAbsolute(inst) ? NULL : getAddrArgExpr(inst, blockgen);
+  Value *lhs = address ? machine.generateLoad(address, blockgen) : loadWord(getAddrArg(inst), blockgen);
+  Value *rhs = blockgen.getConstant((word)1);
+
+  Value *value;
+  if (info.inverse) {
+    value = blockgen.getBuilder().CreateSub(lhs, rhs);
+  } else {
+    value = blockgen.getBuilder().CreateAdd(lhs, rhs);
+  }
 
-DEF_WORD_ARG_INST(BIT)
+  if (address) {
+    machine.generateStore(address, value, blockgen);
+  } else {
+    storeWord(getAddrArg(inst), value, blockgen);
+  }
+  blockgen.setResultFlags(value);
+}
 
-    virtual void generateCode(BlockGenerator &blockgen) const {
-      Value *regVal = blockgen.getRegValue(REG_A);
-      Value *operand = arg->getWordArgExpr(location, blockgen);
+void generateFlag(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  blockgen.setRegValue(info.reg, llvm::ConstantInt::get(blockgen.getFlagType(), info.inverse ? 0 : 1));
+}
 
-      Value *value = blockgen.getBuilder().CreateAnd(regVal, operand);
+void generateFallback(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  writeFallback(inst.location, blockgen);
+}
 
-      setRegN(operand, blockgen);
+void generateBIT(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  Value *operand = getWordArgExpr(inst, blockgen);
 
-      Value *bit6 = blockgen.getBuilder().CreateAnd(operand, blockgen.getConstant((word)0x40));
-      blockgen.setRegValue(REG_V, blockgen.getBuilder().CreateICmpNE(bit6, blockgen.getConstant((word)0)));
+  blockgen.setLazyFlag(REG_N, FLAG_NEGATIVE, operand);
+  blockgen.setLazyFlag(REG_V, FLAG_BITS_SET, operand, blockgen.getConstant((word)0x40));
+  blockgen.setLazyFlag(REG_Z, FLAG_ZERO, blockgen.getBuilder().CreateAnd(blockgen.getRegValue(REG_A), operand));
+}
 
-      setRegZ(value, blockgen);
-    }
-};
+void generateJMP(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  if (isAbsolute(inst)) {
+    writeTailCall(getAddrArg(inst), blockgen);
+  } else {
+    writeIndirectJump(inst, blockgen);
+  }
+}
 
-DEF_WORD_ARG_INST(AND)
-};
+void generateJSR(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  writeCall(inst.getCallTarget(), blockgen);
+}
 
-DEF_NO_ARG_INST(CLD)
-};
+void generateRTS(const DecodedInstruction &inst, const OpcodeInfo &info, BlockGenerator &blockgen) {
+  writeRet(blockgen);
+}
 
-DEF_ADDR_ARG_INST(INC)
-};
+const OpcodeInfo OPCODE_INFO[OP_COUNT] = {
+  {"???", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"ADC", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"AND", 0, generateLogic, REG_A, REG_A, false},
+  {"ASL", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"BCC", INST_BRANCH, generateBranch, REG_C, REG_C, true},
+  {"BCS", INST_BRANCH, generateBranch, REG_C, REG_C, false},
+  {"BEQ", INST_BRANCH, generateBranch, REG_Z, REG_Z, false},
+  {"BIT", 0, generateBIT, REG_A, REG_A, false},
+  {"BMI", INST_BRANCH, generateBranch, REG_N, REG_N, false},
+  {"BNE", INST_BRANCH, generateBranch, REG_Z, REG_Z, true},
+  {"BPL", INST_BRANCH, generateBranch, REG_N, REG_N, true},
+  {"BRK", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"BVC", INST_BRANCH, generateBranch, REG_V, REG_V, true},
+  {"BVS", INST_BRANCH, generateBranch, REG_V, REG_V, false},
+  {"CLC", 0, generateFlag, REG_C, REG_C, true},
+  {"CLD", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"CLI", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"CLV", 0, generateFlag, REG_V, REG_V, true},
+  {"CMP", 0, generateCompare, REG_A, REG_A, false},
+  {"CPX", 0, generateCompare, REG_X, REG_X, false},
+  {"CPY", 0, generateCompare, REG_Y, REG_Y, false},
+  {"DEC", 0, generateMemoryIncrement, REG_A, REG_A, true},
+  {"DEX", 0, generateIncrement, REG_X, REG_X, true},
+  {"DEY", 0, generateIncrement, REG_Y, REG_Y, true},
+  {"EOR", 0, generateLogic, REG_A, REG_A, false},
+  {"INC", 0, generateMemoryIncrement, REG_A, REG_A, false},
+  {"INX", 0, generateIncrement, REG_X, REG_X, false},
+  {"INY", 0, generateIncrement, REG_Y, REG_Y, false},
+  {"JMP", INST_TERMINAL | INST_CALL, generateJMP, REG_A, REG_A, false},
+  {"JSR", INST_CALL, generateJSR, REG_A, REG_A, false},
+  {"LDA", 0, generateRegisterLoad, REG_A, REG_A, false},
+  {"LDX", 0, generateRegisterLoad, REG_X, REG_X, false},
+  {"LDY", 0, generateRegisterLoad, REG_Y, REG_Y, false},
+  {"LSR", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"NOP", 0, generateNothing, REG_A, REG_A, false},
+  {"ORA", 0, generateLogic, REG_A, REG_A, false},
+  {"PHA", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"PHP", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"PLA", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"PLP", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"ROL", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"ROR", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"RTI", INST_TERMINAL, generateRTS, REG_A, REG_A, false},
+  {"RTS", INST_TERMINAL, generateRTS, REG_A, REG_A, false},
+  {"SBC", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"SEC", 0, generateFlag, REG_C, REG_C, false},
+  {"SED", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"SEI", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"STA", 0, generateRegisterStore, REG_A, REG_A, false},
+  {"STX", 0, generateRegisterStore, REG_X, REG_X, false},
+  {"STY", 0, generateRegisterStore, REG_Y, REG_Y, false},
+  {"TAX", 0, generateTransfer, REG_A, REG_X, false},
+  {"TAY", 0, generateTransfer, REG_A, REG_Y, false},
+  {"TSX", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"TXA", 0, generateTransfer, REG_X, REG_A, false},
+  {"TXS", INST_TERMINAL | INST_FALLBACK, generateFallback, REG_A, REG_A, false},
+  {"TYA", 0, generateTransfer, REG_Y, REG_A, false}
+};
+
+bool DecodedInstruction::isTerminal() const {
+  return OPCODE_INFO[opcode].flags & INST_TERMINAL;
+}
 
-DEF_ADDR_ARG_INST(JMP)
-    virtual bool isTerminal() const {
-      return arg->isAbsolute();
-    }
+bool DecodedInstruction::needsFallback() const {
+  return OPCODE_INFO[opcode].flags & INST_FALLBACK;
+}
 
-    virtual bool isCall() const {
-      return arg->isAbsolute();
-    }
+bool DecodedInstruction::isBranch() const {
+  return OPCODE_INFO[opcode].flags & INST_BRANCH;
+}
 
-    virtual addr getCallTarget() const {
-      return arg->getAddrArg(location);
-    }
+addr DecodedInstruction::getBranchTarget() const {
+  return isBranch() ? getAddrArg(*this) : 0;
+}
 
-    virtual void generateCode(BlockGenerator &blockgen) const {
-      // TODO
-      if (arg->isAbsolute()) {
-        writeCall(arg->getAddrArg(location), blockgen);
-        writeRet(blockgen);
-      }
-    }
-};
+bool DecodedInstruction::isCall() const {
+  return (OPCODE_INFO[opcode].flags & INST_CALL) && isAbsolute(*this);
+}
 
-DEF_ADDR_ARG_INST(JSR)
+addr DecodedInstruction::getCallTarget() const {
+  return isCall() ? getAddrArg(*this) : 0;
+}
 
-    virtual bool isCall() const {
-      return true;
-    }
+addr DecodedInstruction::getFollowingLocation() const {
+  return location + length;
+}
 
-    virtual addr getCallTarget() const {
-      return arg->getAddrArg(location);
-    }
+const char *DecodedInstruction::getMnemonic() const {
+  return OPCODE_INFO[opcode].mnemonic;
+}
 
-    virtual void generateCode(BlockGenerator &blockgen) const {
-      writeCall(getCallTarget(), blockgen);
-    }
-};
+void DecodedInstruction::generateCode(BlockGenerator &blockgen) const {
+  const OpcodeInfo &info = OPCODE_INFO[opcode];
+  info.generate(*this, info, blockgen);
+}
 
-DEF_WORD_ARG_INST(ORA)
-};
+Value *generateBranchTaken(const DecodedInstruction &inst, BlockGenerator &blockgen) {
+  const OpcodeInfo &info = OPCODE_INFO[inst.opcode];
+  Value *flag = blockgen.getRegValue(info.reg);
+  return info.inverse ? blockgen.getBuilder().CreateNot(flag) : flag;
+}
 
-DEF_NO_ARG_INST(RTS)
-    virtual bool isTerminal() const {
-      return true;
-    }
+ostream &operator<<(ostream &o, const DecodedInstruction &instruction) {
+  o << hex << uppercase << setfill('0') << setw(4) << instruction.location << ": " << instruction.getMnemonic();
+
+  switch(instruction.mode) {
+    case MODE_IMP:
+      return o;
+    case MODE_ACC:
+      return o << " A";
+    case MODE_IMM:
+      return o << " #$" << setw(2) << instruction.operand;
+    case MODE_ZPG:
+    case MODE_REL:
+      return o << " $" << setw(2) << instruction.operand;
+    case MODE_ZPGX:
+      return o << " $" << setw(2) << instruction.operand << ",X";
+    case MODE_ZPGY:
+      return o << " $" << setw(2) << instruction.operand << ",Y";
+    case MODE_ABS:
+      return o << " $" << setw(4) << instruction.operand;
+    case MODE_ABSX:
+      return o << " $" << setw(4) << instruction.operand << ",X";
+    case MODE_ABSY:
+      return o << " $" << setw(4) << instruction.operand << ",Y";
+    case MODE_IND:
+      return o << " ($" << setw(4) << instruction.operand << ")";
+    case MODE_INDX:
+      return o << " ($" << setw(2) << instruction.operand << ",X)";
+    case MODE_INDY:
+      return o << " ($" << setw(2) << instruction.operand << "),Y";
+    default:
+      return o;
+  }
+}
 
-    virtual void generateCode(BlockGenerator &blockgen) const {
-      writeRet(blockgen);
-    }
-};
+DecodedInstruction decodeInstruction(addr location, word encoding, word low, word high) {
+  const OpcodeEntry &entry = OPCODE_TABLE[encoding];
+
+  DecodedInstruction result;
+  result.location = location;
+  result.encoding = encoding;
+  result.opcode = entry.opcode;
+  result.mode = entry.mode;
+  result.length = 1 + OPERAND_LENGTH[entry.mode];
+
+  switch(OPERAND_LENGTH[entry.mode]) {
+    case 2:
+      result.operand = low + 256 * high;
+      break;
+    case 1:
+      result.operand = low;
+      break;
+    default:
+      result.operand = 0;
+  }
 
-DEF_NO_ARG_INST(SEI)
-};
+  return result;
+}
 
-DEF_NO_ARG_INST(TXS)
-};
+DecodedInstruction readInstruction(addr address, const MachineSpec &machine) {
+  word encoding = machine.readWord(address);
+  DecodedInstruction result = decodeInstruction(address, encoding, machine.readWord(address + 1), machine.readWord(address + 2));
 
-Instruction *readInstruction(addr address, const MachineSpec &machine) {
-  word opcode = machine.readWord(address);
-
-  switch(opcode) {
-    case 0x09:
-      return new ORA(address, new IMMArgument(address + 1, machine));
-    case 0x10:
-      return new BPL(address, new RELArgument(address + 1, machine));
-    case 0x20:
-      return new JSR(address, new ABSArgument(address + 1, machine));
-    case 0x29:
-      return new AND(address, new IMMArgument(address + 1, machine));
-    case 0x2C:
-      return new BIT(address, new ABSArgument(address + 1, machine));
-    case 0x4C:
-      return new JMP(address, new ABSArgument(address + 1, machine));
-    case 0x60:
-      return new RTS(address);
-    case 0x78:
-      return new SEI(address);
-    case 0x85:
-      return new STA(address, new ZPGArgument(address + 1, machine));
-    case 0x86:
-      return new STX(address, new ZPGArgument(address + 1, machine));
-    case 0x88:
-      return new DEY(address);
-    case 0x8A:
-      return new TXA(address);
-    case 0x8D:
-      return new STA(address, new ABSArgument(address + 1, machine));
-    case 0x91:
-      return new STA(address, new INDYArgument(address + 1, machine));
-    case 0x99:
-      return new STA(address, new ABSYArgument(address + 1, machine));
-    case 0x9A:
-      return new TXS(address);
-    case 0xA0:
-      return new LDY(address, new IMMArgument(address + 1, machine));
-    case 0xA2:
-      return new LDX(address, new IMMArgument(address + 1, machine));
-    case 0xA9:
-      return new LDA(address, new IMMArgument(address + 1, machine));
-    case 0xAD:
-      return new LDA(address, new ABSArgument(address + 1, machine));
-    case 0xB0:
-      return new BCS(address, new RELArgument(address + 1, machine));
-    case 0xC0:
-      return new CPY(address, new IMMArgument(address + 1, machine));
-    case 0xC8:
-      return new INY(address);
-    case 0xC9:
-      return new CMP(address, new IMMArgument(address + 1, machine));
-    case 0xCA:
-      return new DEX(address);
-    case 0xD0:
-      return new BNE(address, new RELArgument(address + 1, machine));
-    case 0xBD:
-      return new LDA(address, new ABSXArgument(address + 1, machine));
-    case 0xD8:
-      return new CLD(address);
-    case 0xE0:
-      return new CPX(address, new IMMArgument(address + 1, machine));
-    case 0xEE:
-      return new INC(address, new ABSArgument(address + 1, machine));
+  if (result.opcode == OP_UNKNOWN) {
+    std::cerr << "Unknown instruction " << hex << setw(2) << setfill('0') << uppercase << (int)encoding << " at " << setw(4) << address << std::endl;
   }
 
-  std::cerr << "Unknown instruction " << hex << setw(2) << setfill('0') << uppercase << (int)opcode << " at " << setw(4) << address << std::endl;
-  //exit(1);
-  return new RTS(address);
-
-  return NULL;
+  return result;
 }
@@ -4,29 +4,120 @@
 
 #include "memory.hpp"
 
+namespace llvm {
+  class Value;
+}
+
 class MachineSpec;
 class BlockGenerator;
 
-class Instruction {
-  public:
-    Instruction(addr, const char *);
+enum Opcode : uint8_t {
+  OP_UNKNOWN,
+  OP_ADC,
+  OP_AND,
+  OP_ASL,
+  OP_BCC,
+  OP_BCS,
+  OP_BEQ,
+  OP_BIT,
+  OP_BMI,
+  OP_BNE,
+  OP_BPL,
+  OP_BRK,
+  OP_BVC,
+  OP_BVS,
+  OP_CLC,
+  OP_CLD,
+  OP_CLI,
+  OP_CLV,
+  OP_CMP,
+  OP_CPX,
+  OP_CPY,
+  OP_DEC,
+  OP_DEX,
+  OP_DEY,
+  OP_EOR,
+  OP_INC,
+  OP_INX,
+  OP_INY,
+  OP_JMP,
+  OP_JSR,
+  OP_LDA,
+  OP_LDX,
+  OP_LDY,
+  OP_LSR,
+  OP_NOP,
+  OP_ORA,
+  OP_PHA,
+  OP_PHP,
+  OP_PLA,
+  OP_PLP,
+  OP_ROL,
+  OP_ROR,
+  OP_RTI,
+  OP_RTS,
+  OP_SBC,
+  OP_SEC,
+  OP_SED,
+  OP_SEI,
+  OP_STA,
+  OP_STX,
+  OP_STY,
+  OP_TAX,
+  OP_TAY,
+  OP_TSX,
+  OP_TXA,
+  OP_TXS,
+  OP_TYA,
+  OP_COUNT
+};
+
+enum AddressingMode : uint8_t {
+  MODE_IMP,
+  MODE_ACC,
+  MODE_IMM,
+  MODE_ZPG,
+  MODE_ZPGX,
+  MODE_ZPGY,
+  MODE_ABS,
+  MODE_ABSX,
+  MODE_ABSY,
+  MODE_IND,
+  MODE_INDX,
+  MODE_INDY,
+  MODE_REL,
+  MODE_COUNT
+};
+
+struct OpcodeEntry {
+  Opcode opcode;
+  AddressingMode mode;
+};
 
-    virtual std::ostream &write(std::ostream& o) const = 0;
-    virtual addr getEncodedLength() const = 0;
-    virtual bool isTerminal() const;
-    virtual bool isBranch() const;
-    virtual addr getBranchTarget() const;
-    virtual bool isCall() const;
-    virtual addr getCallTarget() const;
-    virtual void generateCode(BlockGenerator &codegen) const;
+extern const OpcodeEntry OPCODE_TABLE[256];
+extern const word OPERAND_LENGTH[MODE_COUNT];
 
-    addr getFollowingLocation() const;
+struct DecodedInstruction {
+  addr location;
+  addr operand;
+  Opcode opcode;
+  AddressingMode mode;
+  word length;
+  word encoding;
 
-  protected:
-    const char *opcode;
-    addr location;
+  bool isTerminal() const;
+  bool needsFallback() const;
+  bool isBranch() const;
+  addr getBranchTarget() const;
+  bool isCall() const;
+  addr getCallTarget() const;
+  addr getFollowingLocation() const;
+  const char *getMnemonic() const;
+  void generateCode(BlockGenerator &blockgen) const;
 };
 
-std::ostream &operator<<(std::ostream &o, const Instruction &instruction);
+std::ostream &operator<<(std::ostream &o, const DecodedInstruction &instruction);
 
-Instruction *readInstruction(addr, const MachineSpec &);
+DecodedInstruction decodeInstruction(addr location, word encoding, word low, word high);
+DecodedInstruction readInstruction(addr, const MachineSpec &);
+llvm::Value *generateBranchTaken(const DecodedInstruction &inst, BlockGenerator &blockgen);
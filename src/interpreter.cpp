@@ -0,0 +1,394 @@
+#include "interpreter.hpp"
+
+#include <iostream>
+
+#include <iomanip>
+using std::hex;
+using std::uppercase;
+using std::setfill;
+using std::setw;
+
+const uint32_t PROMOTION_THRESHOLD = 64;
+const int32_t INTERPRETED_CYCLES = 3;
+
+const addr STACK_BASE = 0x0100;
+const addr BRK_VECTOR = 0xFFFE;
+
+const word FLAG_C = 0x01;
+const word FLAG_Z = 0x02;
+const word FLAG_I = 0x04;
+const word FLAG_D = 0x08;
+const word FLAG_B = 0x10;
+const word FLAG_U = 0x20;
+const word FLAG_V = 0x40;
+const word FLAG_N = 0x80;
+
+void setNZ(word value, RegisterState &regs) {
+  regs.n = value >> 7;
+  regs.z = value == 0;
+}
+
+Interpreter::Interpreter(NesRuntime &runtime) :
+  runtime(runtime),
+  sp(0xFF),
+  status(FLAG_I)
+{}
+
+void Interpreter::setNativeTier(NativeResolver resolver, NativePromoter promoter) {
+  this->resolver = resolver;
+  this->promoter = promoter;
+}
+
+addr Interpreter::readPointer(addr address, bool wrapPage) {
+  addr high = wrapPage ? ((address & 0xFF00) | ((address + 1) & 0x00FF)) : (addr)(address + 1);
+  return runtime.read(address) | (runtime.read(high) << 8);
+}
+
+addr Interpreter::getAddress(const DecodedInstruction &inst, const RegisterState &regs) {
+  switch (inst.mode) {
+    case MODE_ZPGX:
+      return (word)(inst.operand + regs.x);
+    case MODE_ZPGY:
+      return (word)(inst.operand + regs.y);
+    case MODE_ABSX:
+      return inst.operand + regs.x;
+    case MODE_ABSY:
+      return inst.operand + regs.y;
+    case MODE_IND:
+      return readPointer(inst.operand, true);
+    case MODE_INDX:
+      return readPointer((word)(inst.operand + regs.x), true);
+    case MODE_INDY:
+      return readPointer(inst.operand, true) + regs.y;
+    default:
+      return inst.operand;
+  }
+}
+
+word Interpreter::readOperand(const DecodedInstruction &inst, const RegisterState &regs) {
+  switch (inst.mode) {
+    case MODE_IMM:
+      return inst.operand;
+    case MODE_ACC:
+      return regs.a;
+    default:
+      return runtime.read(getAddress(inst, regs));
+  }
+}
+
+void Interpreter::writeOperand(const DecodedInstruction &inst, word value, RegisterState &regs) {
+  if (inst.mode == MODE_ACC) {
+    regs.a = value;
+  } else {
+    runtime.write(getAddress(inst, regs), value);
+  }
+}
+
+void Interpreter::push(word value) {
+  runtime.write(STACK_BASE + sp--, value);
+}
+
+word Interpreter::pull() {
+  return runtime.read(STACK_BASE + ++sp);
+}
+
+word Interpreter::packStatus(const RegisterState &regs, bool brk) const {
+  return (regs.n ? FLAG_N : 0) | (regs.v ? FLAG_V : 0) | FLAG_U | (brk ? FLAG_B : 0) |
+    (status & (FLAG_D | FLAG_I)) | (regs.z ? FLAG_Z : 0) | (regs.c ? FLAG_C : 0);
+}
+
+void Interpreter::unpackStatus(word value, RegisterState &regs) {
+  regs.n = (value & FLAG_N) != 0;
+  regs.v = (value & FLAG_V) != 0;
+  regs.z = (value & FLAG_Z) != 0;
+  regs.c = (value & FLAG_C) != 0;
+  status = value & (FLAG_D | FLAG_I);
+}
+
+void Interpreter::getStateRegions(std::vector<StateRegion> &regions) {
+  regions.push_back({&sp, 1, 0});
+  regions.push_back({&status, 1, 0});
+}
+
+EntryPoint Interpreter::findNative(addr target, bool transfer) {
+  if (!resolver) {
+    return NULL;
+  }
+
+  if (++counts[target] == PROMOTION_THRESHOLD && promoter) {
+    promoter(target);
+  }
+
+  return resolver(target, transfer);
+}
+
+EntryPoint Interpreter::enterNative(addr target, bool transfer, RegisterState &regs) {
+  EntryPoint native = findNative(target, transfer);
+  runtime.enter(native, regs);
+  return native;
+}
+
+// Native code runs the entry this returns itself, so only targets without
+// one are interpreted here.
+EntryPoint Interpreter::dispatch(addr target, RegisterState &regs) {
+  EntryPoint native = findNative(target, false);
+  if (!native) {
+    run(target, regs);
+  }
+  return native;
+}
+
+// Interpreted code pays for its instructions out of the same cycle budget
+// as native code and polls it at the same places, backward jumps.
+void Interpreter::pollInterrupts() {
+  MachineState *state = runtime.getState();
+  if (state->cycleBudget <= 0) {
+    runtime.poll();
+  }
+}
+
+void Interpreter::run(addr pc, RegisterState &regs) {
+  word entrySp = sp;
+  MachineState *state = runtime.getState();
+
+  while (true) {
+    state->cycleBudget -= INTERPRETED_CYCLES;
+    DecodedInstruction inst = decodeInstruction(pc, runtime.read(pc), runtime.read(pc + 1), runtime.read(pc + 2));
+    addr next = inst.getFollowingLocation();
+
+    switch (inst.opcode) {
+      case OP_LDA:
+        setNZ(regs.a = readOperand(inst, regs), regs);
+        break;
+      case OP_LDX:
+        setNZ(regs.x = readOperand(inst, regs), regs);
+        break;
+      case OP_LDY:
+        setNZ(regs.y = readOperand(inst, regs), regs);
+        break;
+      case OP_STA:
+        writeOperand(inst, regs.a, regs);
+        break;
+      case OP_STX:
+        writeOperand(inst, regs.x, regs);
+        break;
+      case OP_STY:
+        writeOperand(inst, regs.y, regs);
+        break;
+      case OP_TAX:
+        setNZ(regs.x = regs.a, regs);
+        break;
+      case OP_TAY:
+        setNZ(regs.y = regs.a, regs);
+        break;
+      case OP_TXA:
+        setNZ(regs.a = regs.x, regs);
+        break;
+      case OP_TYA:
+        setNZ(regs.a = regs.y, regs);
+        break;
+      case OP_TSX:
+        setNZ(regs.x = sp, regs);
+        break;
+      case OP_TXS:
+        sp = regs.x;
+        break;
+      case OP_PHA:
+        push(regs.a);
+        break;
+      case OP_PHP:
+        push(packStatus(regs, true));
+        break;
+      case OP_PLA:
+        setNZ(regs.a = pull(), regs);
+        break;
+      case OP_PLP:
+        unpackStatus(pull(), regs);
+        break;
+      case OP_AND:
+        setNZ(regs.a &= readOperand(inst, regs), regs);
+        break;
+      case OP_ORA:
+        setNZ(regs.a |= readOperand(inst, regs), regs);
+        break;
+      case OP_EOR:
+        setNZ(regs.a ^= readOperand(inst, regs), regs);
+        break;
+      case OP_ADC:
+      case OP_SBC: {
+        word operand = readOperand(inst, regs);
+        if (inst.opcode == OP_SBC) {
+          operand = ~operand;
+        }
+        unsigned sum = regs.a + operand + (regs.c ? 1 : 0);
+        regs.v = (~(regs.a ^ operand) & (regs.a ^ sum) & 0x80) != 0;
+        regs.c = sum > 0xFF;
+        setNZ(regs.a = sum, regs);
+        break;
+      }
+      case OP_CMP:
+      case OP_CPX:
+      case OP_CPY: {
+        word lhs = inst.opcode == OP_CMP ? regs.a : inst.opcode == OP_CPX ? regs.x : regs.y;
+        word rhs = readOperand(inst, regs);
+        regs.c = lhs >= rhs;
+        setNZ(lhs - rhs, regs);
+        break;
+      }
+      case OP_BIT: {
+        word operand = readOperand(inst, regs);
+        regs.n = (operand & FLAG_N) != 0;
+        regs.v = (operand & FLAG_V) != 0;
+        regs.z = (regs.a & operand) == 0;
+        break;
+      }
+      case OP_INC:
+      case OP_DEC: {
+        word value = readOperand(inst, regs) + (inst.opcode == OP_INC ? 1 : -1);
+        writeOperand(inst, value, regs);
+        setNZ(value, regs);
+        break;
+      }
+      case OP_INX:
+        setNZ(++regs.x, regs);
+        break;
+      case OP_INY:
+        setNZ(++regs.y, regs);
+        break;
+      case OP_DEX:
+        setNZ(--regs.x, regs);
+        break;
+      case OP_DEY:
+        setNZ(--regs.y, regs);
+        break;
+      case OP_ASL:
+      case OP_LSR:
+      case OP_ROL:
+      case OP_ROR: {
+        word operand = readOperand(inst, regs);
+        word carry = regs.c ? 1 : 0;
+        word value;
+        if (inst.opcode == OP_ASL || inst.opcode == OP_ROL) {
+          value = (operand << 1) | (inst.opcode == OP_ROL ? carry : 0);
+          regs.c = operand >> 7;
+        } else {
+          value = (operand >> 1) | (inst.opcode == OP_ROR ? carry << 7 : 0);
+          regs.c = operand & 1;
+        }
+        writeOperand(inst, value, regs);
+        setNZ(value, regs);
+        break;
+      }
+      case OP_CLC:
+        regs.c = 0;
+        break;
+      case OP_SEC:
+        regs.c = 1;
+        break;
+      case OP_CLV:
+        regs.v = 0;
+        break;
+      case OP_CLD:
+        status &= ~FLAG_D;
+        break;
+      case OP_SED:
+        status |= FLAG_D;
+        break;
+      case OP_CLI:
+        status &= ~FLAG_I;
+        break;
+      case OP_SEI:
+        status |= FLAG_I;
+        break;
+      case OP_NOP:
+        break;
+      case OP_BCC:
+      case OP_BCS:
+      case OP_BEQ:
+      case OP_BNE:
+      case OP_BMI:
+      case OP_BPL:
+      case OP_BVC:
+      case OP_BVS: {
+        bool taken;
+        switch (inst.opcode) {
+          case OP_BCC: taken = !regs.c; break;
+          case OP_BCS: taken = regs.c; break;
+          case OP_BEQ: taken = regs.z; break;
+          case OP_BNE: taken = !regs.z; break;
+          case OP_BMI: taken = regs.n; break;
+          case OP_BPL: taken = !regs.n; break;
+          case OP_BVC: taken = !regs.v; break;
+          default: taken = regs.v;
+        }
+        if (taken) {
+          next = inst.getBranchTarget();
+          if (next <= pc) {
+            pollInterrupts();
+          }
+          if (next <= pc && sp == entrySp && enterNative(next, true, regs)) {
+            return;
+          }
+        }
+        break;
+      }
+      case OP_JMP:
+        next = getAddress(inst, regs);
+        if (next <= pc) {
+          pollInterrupts();
+        }
+        if (sp == entrySp && enterNative(next, true, regs)) {
+          return;
+        }
+        break;
+      case OP_JSR:
+        if (!enterNative(inst.operand, false, regs)) {
+          push((pc + 2) >> 8);
+          push((pc + 2) & 0xFF);
+          next = inst.operand;
+        }
+        break;
+      case OP_RTS:
+        if (sp == entrySp) {
+          return;
+        }
+        next = pull();
+        next |= pull() << 8;
+        next++;
+        if (sp == entrySp && enterNative(next, true, regs)) {
+          return;
+        }
+        break;
+      case OP_RTI:
+        if (sp == entrySp) {
+          return;
+        }
+        unpackStatus(pull(), regs);
+        next = pull();
+        next |= pull() << 8;
+        break;
+      case OP_BRK: {
+        word pushed = packStatus(regs, true);
+        addr handler = readPointer(BRK_VECTOR, false);
+        status |= FLAG_I;
+        // A native handler returns like a call, so nothing is pushed for
+        // it and the flags its RTI would restore are restored here.
+        if (enterNative(handler, false, regs)) {
+          unpackStatus(pushed, regs);
+          next = pc + 2;
+          break;
+        }
+        push((pc + 2) >> 8);
+        push((pc + 2) & 0xFF);
+        push(pushed);
+        next = handler;
+        break;
+      }
+      default:
+        std::cerr << "Illegal instruction " << hex << uppercase << setfill('0') << setw(2) << (int)inst.encoding << " at " << setw(4) << pc << std::endl;
+        return;
+    }
+
+    pc = next;
+  }
+}
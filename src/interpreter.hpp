@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "addr_map.hpp"
+#include "instruction.hpp"
+#include "memory.hpp"
+#include "runtime.hpp"
+#include "savestate.hpp"
+
+typedef std::function<EntryPoint(addr start, bool transfer)> NativeResolver;
+typedef std::function<void(addr start)> NativePromoter;
+
+class Interpreter {
+  public:
+    Interpreter(NesRuntime &runtime);
+
+    void setNativeTier(NativeResolver resolver, NativePromoter promoter);
+    void run(addr pc, RegisterState &regs);
+    EntryPoint dispatch(addr target, RegisterState &regs);
+    void getStateRegions(std::vector<StateRegion> &regions);
+
+  private:
+    addr getAddress(const DecodedInstruction &inst, const RegisterState &regs);
+    word readOperand(const DecodedInstruction &inst, const RegisterState &regs);
+    void writeOperand(const DecodedInstruction &inst, word value, RegisterState &regs);
+    addr readPointer(addr address, bool wrapPage);
+
+    void push(word value);
+    word pull();
+    word packStatus(const RegisterState &regs, bool brk) const;
+    void unpackStatus(word status, RegisterState &regs);
+
+    EntryPoint findNative(addr target, bool transfer);
+    EntryPoint enterNative(addr target, bool transfer, RegisterState &regs);
+    void pollInterrupts();
+
+    NesRuntime &runtime;
+    word sp;
+    word status;
+    NativeResolver resolver;
+    NativePromoter promoter;
+    AddrMap<uint32_t> counts;
+};
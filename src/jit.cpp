@@ -0,0 +1,87 @@
+#include "jit.hpp"
+
+#include <cstdio>
+
+#include <memory>
+using std::unique_ptr;
+
+#include <string>
+using std::string;
+
+#include <iostream>
+
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Module.h"
+using llvm::EngineBuilder;
+using llvm::GlobalValue;
+using llvm::GlobalVariable;
+using llvm::Module;
+using llvm::RTDyldMemoryManager;
+using llvm::SectionMemoryManager;
+
+class RuntimeMemoryManager : public SectionMemoryManager {
+  public:
+    RuntimeMemoryManager(NesRuntime &runtime) :
+      runtime(runtime)
+    {}
+
+    virtual uint64_t getSymbolAddress(const string &name) {
+      void *symbol = lookupRuntimeSymbol(name, runtime);
+      if (symbol) {
+        return (uint64_t)symbol;
+      }
+      return SectionMemoryManager::getSymbolAddress(name);
+    }
+
+  private:
+    NesRuntime &runtime;
+};
+
+// Modules are optimized before they get here, so even constant globals
+// like the ROM image can refer to the runtime's copy.
+void bindRuntimeGlobals(Module &module, NesRuntime &runtime) {
+  for (GlobalVariable &global : module.globals()) {
+    if (lookupRuntimeSymbol(global.getName().str(), runtime)) {
+      global.setInitializer(NULL);
+      global.setLinkage(GlobalValue::ExternalLinkage);
+    }
+  }
+}
+
+Jit::Jit(NesRuntime &runtime) :
+  runtime(runtime)
+{}
+
+bool Jit::addModule(unique_ptr<Module> module) {
+  runtime.makeCurrent();
+  bindRuntimeGlobals(*module, runtime);
+
+  if (engine) {
+    engine->addModule(std::move(module));
+  } else {
+    string error;
+    engine.reset(EngineBuilder(std::move(module))
+      .setEngineKind(llvm::EngineKind::JIT)
+      .setErrorStr(&error)
+      .setOptLevel(llvm::CodeGenOpt::Default)
+      .setMCJITMemoryManager(unique_ptr<RTDyldMemoryManager>(new RuntimeMemoryManager(runtime)))
+      .create());
+
+    if (!engine) {
+      std::cerr << "Could not create JIT: " << error << std::endl;
+      return false;
+    }
+  }
+
+  engine->finalizeObject();
+  return true;
+}
+
+EntryPoint Jit::getEntryPoint(addr start) {
+  char name[7];
+  sprintf(name, "e_%04X", start);
+  return (EntryPoint)engine->getFunctionAddress(name);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <memory>
+
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/IR/Module.h"
+
+#include "memory.hpp"
+#include "runtime.hpp"
+
+class Jit {
+  public:
+    Jit(NesRuntime &runtime);
+
+    bool addModule(std::unique_ptr<llvm::Module> module);
+    EntryPoint getEntryPoint(addr start);
+
+  private:
+    NesRuntime &runtime;
+    std::unique_ptr<llvm::ExecutionEngine> engine;
+};
@@ -0,0 +1,220 @@
+#include "liveness.hpp"
+
+#include <vector>
+using std::vector;
+
+#include "addr_map.hpp"
+#include "program.hpp"
+
+const RegisterMask A = 1 << REG_A;
+const RegisterMask X = 1 << REG_X;
+const RegisterMask Y = 1 << REG_Y;
+const RegisterMask N = 1 << REG_N;
+const RegisterMask V = 1 << REG_V;
+const RegisterMask Z = 1 << REG_Z;
+const RegisterMask C = 1 << REG_C;
+const RegisterMask NZ = N | Z;
+
+RegisterMask getIndexUses(const DecodedInstruction &inst) {
+  switch (inst.mode) {
+    case MODE_ZPGX:
+    case MODE_ABSX:
+    case MODE_INDX:
+      return X;
+    case MODE_ZPGY:
+    case MODE_ABSY:
+    case MODE_INDY:
+      return Y;
+    default:
+      return 0;
+  }
+}
+
+void getInstructionEffects(const DecodedInstruction &inst, RegisterMask &uses, RegisterMask &defs) {
+  RegisterMask acc = inst.mode == MODE_ACC ? A : 0;
+  uses = getIndexUses(inst);
+  defs = 0;
+
+  switch (inst.opcode) {
+    case OP_LDA: defs = A | NZ; break;
+    case OP_LDX: defs = X | NZ; break;
+    case OP_LDY: defs = Y | NZ; break;
+    case OP_STA: uses |= A; break;
+    case OP_STX: uses |= X; break;
+    case OP_STY: uses |= Y; break;
+    case OP_TAX: uses = A; defs = X | NZ; break;
+    case OP_TAY: uses = A; defs = Y | NZ; break;
+    case OP_TXA: uses = X; defs = A | NZ; break;
+    case OP_TYA: uses = Y; defs = A | NZ; break;
+    case OP_TSX: defs = X | NZ; break;
+    case OP_TXS: uses = X; break;
+    case OP_AND:
+    case OP_ORA:
+    case OP_EOR: uses |= A; defs = A | NZ; break;
+    case OP_ADC:
+    case OP_SBC: uses |= A | C; defs = A | NZ | V | C; break;
+    case OP_CMP: uses |= A; defs = NZ | C; break;
+    case OP_CPX: uses |= X; defs = NZ | C; break;
+    case OP_CPY: uses |= Y; defs = NZ | C; break;
+    case OP_BIT: uses |= A; defs = NZ | V; break;
+    case OP_INC:
+    case OP_DEC: defs = NZ; break;
+    case OP_INX:
+    case OP_DEX: uses = X; defs = X | NZ; break;
+    case OP_INY:
+    case OP_DEY: uses = Y; defs = Y | NZ; break;
+    case OP_ASL:
+    case OP_LSR: uses |= acc; defs = acc | NZ | C; break;
+    case OP_ROL:
+    case OP_ROR: uses |= acc | C; defs = acc | NZ | C; break;
+    case OP_CLC:
+    case OP_SEC: defs = C; break;
+    case OP_CLV: defs = V; break;
+    case OP_BCC:
+    case OP_BCS: uses = C; break;
+    case OP_BEQ:
+    case OP_BNE: uses = Z; break;
+    case OP_BMI:
+    case OP_BPL: uses = N; break;
+    case OP_BVC:
+    case OP_BVS: uses = V; break;
+    case OP_PHA: uses = A; break;
+    case OP_PHP: uses = N | V | Z | C; break;
+    case OP_PLA: defs = A | NZ; break;
+    case OP_PLP: defs = N | V | Z | C; break;
+    case OP_CLD:
+    case OP_CLI:
+    case OP_SED:
+    case OP_SEI:
+    case OP_NOP: break;
+    default: uses = ALL_REGISTERS; defs = ALL_REGISTERS;
+  }
+}
+
+// Effects as seen by the generated code, which depends on the callee's
+// signature and, for returns, on the signature of the function itself.
+void getCodeEffects(const DecodedInstruction &inst, const FunctionSignature &self, const Program &program, RegisterMask &uses, RegisterMask &defs) {
+  if (inst.needsFallback() || (inst.opcode == OP_JMP && !inst.isCall())) {
+    uses = ALL_REGISTERS;
+    defs = ALL_REGISTERS;
+  } else if (inst.opcode == OP_RTS || inst.opcode == OP_RTI) {
+    uses = self.rets;
+    defs = 0;
+  } else if (inst.isCall()) {
+    const FunctionSignature &callee = program.getFunction(inst.getCallTarget()).signature;
+    uses = callee.args;
+    defs = callee.rets;
+    if (inst.isTerminal()) {
+      uses |= self.rets & ~callee.rets;
+    }
+  } else {
+    getInstructionEffects(inst, uses, defs);
+  }
+}
+
+void analyzeFunction(const FunctionInfo &function, const Program &program, RegisterMask &liveIn, RegisterMask &mayDef) {
+  vector<addr> order(function.instructions.begin(), function.instructions.end());
+  AddrMap<RegisterMask> live;
+  mayDef = 0;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+      const DecodedInstruction &inst = program.getInstruction(*it);
+      RegisterMask uses, defs;
+      getCodeEffects(inst, function.signature, program, uses, defs);
+      mayDef |= defs;
+
+      RegisterMask out = 0;
+      const RegisterMask *succ;
+      if (!inst.isTerminal() && (succ = live.find(inst.getFollowingLocation()))) {
+        out |= *succ;
+      }
+      if (inst.isBranch() && (succ = live.find(inst.getBranchTarget()))) {
+        out |= *succ;
+      }
+
+      RegisterMask in = uses | (out & ~defs);
+      RegisterMask &current = live[*it];
+      if (in != current) {
+        current = in;
+        changed = true;
+      }
+    }
+  }
+
+  liveIn = live[function.start];
+}
+
+addr findComponent(AddrMap<addr> &components, addr start) {
+  while (components[start] != start) {
+    start = components[start] = components[components[start]];
+  }
+  return start;
+}
+
+// Functions connected by tail calls share one signature so that the
+// calls between them can stay musttail. Functions whose signature was
+// fixed by an earlier run are left alone; tail calls into them simply
+// widen the new component.
+void computeSignatures(Program &program) {
+  vector<addr> pending;
+  AddrMap<addr> components;
+  for (auto funcStart : program.getFunctions()) {
+    FunctionInfo &function = program.getFunction(funcStart);
+    if (!function.hasSignature) {
+      function.signature.args = 0;
+      function.signature.rets = 0;
+      pending.push_back(funcStart);
+      components[funcStart] = funcStart;
+    }
+  }
+
+  for (auto funcStart : pending) {
+    for (auto instAddress : program.getFunction(funcStart).instructions) {
+      const DecodedInstruction &inst = program.getInstruction(instAddress);
+      if (inst.isCall() && inst.isTerminal() && components.count(inst.getCallTarget())) {
+        components[findComponent(components, funcStart)] = findComponent(components, inst.getCallTarget());
+      }
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    AddrMap<FunctionSignature> merged;
+    for (auto funcStart : pending) {
+      const FunctionInfo &function = program.getFunction(funcStart);
+      FunctionSignature &signature = merged[findComponent(components, funcStart)];
+
+      RegisterMask liveIn, mayDef;
+      analyzeFunction(function, program, liveIn, mayDef);
+      signature.args |= liveIn;
+      signature.rets |= mayDef;
+
+      for (auto instAddress : function.instructions) {
+        const DecodedInstruction &inst = program.getInstruction(instAddress);
+        if (inst.isCall() && inst.isTerminal() && !components.count(inst.getCallTarget())) {
+          const FunctionSignature &callee = program.getFunction(inst.getCallTarget()).signature;
+          signature.args |= callee.args;
+          signature.rets |= callee.rets;
+        }
+      }
+    }
+
+    for (auto funcStart : pending) {
+      FunctionInfo &function = program.getFunction(funcStart);
+      const FunctionSignature &signature = merged[findComponent(components, funcStart)];
+      if (function.signature != signature) {
+        function.signature = signature;
+        changed = true;
+      }
+    }
+  }
+
+  for (auto funcStart : pending) {
+    program.getFunction(funcStart).hasSignature = true;
+  }
+}
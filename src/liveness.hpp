@@ -0,0 +1,9 @@
+#pragma once
+
+#include "instruction.hpp"
+#include "registers.hpp"
+
+class Program;
+
+void getInstructionEffects(const DecodedInstruction &inst, RegisterMask &uses, RegisterMask &defs);
+void computeSignatures(Program &program);
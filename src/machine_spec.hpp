@@ -4,12 +4,21 @@
 
 #include "memory.hpp"
 
+namespace llvm {
+  class Module;
+}
+
 class ModuleGenerator;
 class BlockGenerator;
 
 class MachineSpec {
   public:
     virtual word readWord(addr) const = 0;
+    virtual bool isReadOnly(addr) const = 0;
+    virtual addr getPrgRomSize() const = 0;
+    virtual addr getPrgRomOffset() const = 0;
+    virtual bool hasPrgRam() const = 0;
+    virtual bool isIdleRead(addr) const = 0;
     addr readAddr(addr) const;
 
     addr getNMIAddr() const;
@@ -17,8 +26,13 @@ class MachineSpec {
     addr getBRKAddr() const;
 
     virtual void writeLLVMHeader(ModuleGenerator &modgen) const = 0;
+    virtual void writeLLVMDefinitions(llvm::Module &module) const = 0;
     virtual llvm::Value *generateLoad(addr address, BlockGenerator &blockgen) const = 0;
     virtual llvm::Value *generateLoad(llvm::Value *address, BlockGenerator &blockgen) const = 0;
+    virtual llvm::Value *generateIndexedLoad(addr base, llvm::Value *index, BlockGenerator &blockgen) const = 0;
     virtual void generateStore(addr address, llvm::Value *value, BlockGenerator &blockgen) const = 0;
     virtual void generateStore(llvm::Value *address, llvm::Value *value, BlockGenerator &blockgen) const = 0;
+    virtual llvm::Value *getPendingEntryPtr(BlockGenerator &blockgen) const = 0;
+    virtual void generateInterruptPoll(unsigned cycles, BlockGenerator &blockgen) const = 0;
+    virtual void generateIdleWait(llvm::Value *waiting, BlockGenerator &blockgen) const = 0;
 };
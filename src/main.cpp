@@ -1,23 +1,193 @@
 #include <cstdint>
 #include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <algorithm>
+#include <getopt.h>
 #include <memory>
 #include <iostream>
 #include <iomanip>
 #include <bitset>
-#include <set>
+#include <fstream>
+#include <string>
+#include <vector>
 
 #include <boost/iostreams/device/mapped_file.hpp>
 #include "llvm/IR/Module.h"
 #include "llvm/IR/LLVMContext.h"
 
+#include "addr_set.hpp"
+#include "backend.hpp"
+#include "batch.hpp"
+#include "cache.hpp"
 #include "memory.hpp"
 #include "nes_machine_spec.hpp"
 #include "instruction.hpp"
 #include "flow.hpp"
+#include "program.hpp"
 #include "codegen.hpp"
+#include "interpreter.hpp"
+#include "jit.hpp"
+#include "runtime.hpp"
+#include "savestate.hpp"
+#include "shard.hpp"
+
+// One controller state per line, as a hex button mask.
+bool loadInputScript(const char *path, std::vector<InputScript> &inputs) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+
+  InputScript script;
+  unsigned buttons;
+  while (in >> std::hex >> buttons) {
+    script.push_back(buttons);
+  }
+  inputs.push_back(script);
+  return true;
+}
+
+// Final machine states of every instance, each stored against the one
+// before it since instances tend to end up in similar states.
+bool saveBatchStates(BatchExecutor &executor, unsigned instances, const char *path) {
+  std::ofstream out(path, std::ios::binary);
+  std::vector<word> reference;
+  for (unsigned i = 0; i < instances; i++) {
+    std::vector<word> state = executor.getMachineState(i);
+    writeStateDelta(state, reference, out);
+    reference = state;
+  }
+  return (bool)out;
+}
+
+// Compares the final states against ones saved by an earlier run, which
+// catches recompiler or rollback changes that alter what the game does.
+bool checkBatchStates(BatchExecutor &executor, unsigned instances, const char *path) {
+  std::ifstream in(path, std::ios::binary);
+  std::vector<word> reference;
+  unsigned mismatches = 0;
+  for (unsigned i = 0; i < instances; i++) {
+    std::vector<word> expected;
+    if (!readStateDelta(in, reference, expected)) {
+      fprintf(stderr, "Could not read state %u from %s\n", i, path);
+      return false;
+    }
+    if (executor.getMachineState(i) != expected) {
+      fprintf(stderr, "Instance %u does not match the saved state\n", i);
+      mismatches++;
+    }
+    reference = expected;
+  }
+  return mismatches == 0;
+}
 
 int main(int argc, char **argv) {
-  boost::iostreams::mapped_file file(argv[1]);
+  CodegenOptions options;
+  options.jobs = 1;
+  options.cache = NULL;
+  options.optLevel = OPT_O0;
+  options.exportFunctions = false;
+  options.instanced = false;
+
+  std::unique_ptr<CodeCache> cache;
+  std::string output;
+  bool run = false;
+  BatchOptions batch;
+  batch.instances = 0;
+  batch.frames = 600;
+  batch.framesPerSlice = 1;
+  batch.historySize = 0;
+  std::vector<InputScript> inputs;
+  uint64_t rewindFrame = 0;
+  const char *saveState = NULL;
+  const char *checkState = NULL;
+
+  static const struct option longOptions[] = {
+    {"run", no_argument, NULL, 'r'},
+    {"instanced", no_argument, NULL, 'i'},
+    {"batch", required_argument, NULL, 'b'},
+    {"frames", required_argument, NULL, 'f'},
+    {"input", required_argument, NULL, 'I'},
+    {"history", required_argument, NULL, 'H'},
+    {"rewind", required_argument, NULL, 'R'},
+    {"save-state", required_argument, NULL, 'S'},
+    {"check-state", required_argument, NULL, 'K'},
+    {NULL, 0, NULL, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "j:C:O:o:rib:f:I:H:R:S:K:", longOptions, NULL)) != -1) {
+    switch (opt) {
+      case 'j':
+        options.jobs = std::max(atoi(optarg), 1);
+        break;
+      case 'C':
+        cache.reset(new CodeCache(optarg));
+        options.cache = cache.get();
+        break;
+      case 'O':
+        if (!parseOptLevel(optarg, options.optLevel)) {
+          fprintf(stderr, "Unknown optimization level -O%s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'r':
+        run = true;
+        options.exportFunctions = true;
+        break;
+      case 'i':
+        options.instanced = true;
+        break;
+      case 'b':
+        batch.instances = atoi(optarg);
+        run = true;
+        options.exportFunctions = true;
+        options.instanced = true;
+        break;
+      case 'f':
+        batch.frames = strtoull(optarg, NULL, 10);
+        break;
+      case 'I':
+        if (!loadInputScript(optarg, inputs)) {
+          fprintf(stderr, "Could not read input script %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'H':
+        batch.historySize = atoi(optarg);
+        break;
+      case 'R':
+        rewindFrame = strtoull(optarg, NULL, 10);
+        break;
+      case 'S':
+        saveState = optarg;
+        break;
+      case 'K':
+        checkState = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-j jobs] [-C cachedir] [-O0|1|2|3|t] [-o out.ll|out.bc|out.o] [--run] [--instanced] [--batch instances [--frames n] [--input script]... [--history n [--rewind frame]] [--save-state|--check-state file]] rom.nes\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (rewindFrame && !batch.historySize) {
+    fprintf(stderr, "--rewind needs a --history to rewind through\n");
+    return 1;
+  }
+
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-j jobs] [-C cachedir] [-O0|1|2|3|t] [-o out.ll|out.bc|out.o] [--run] [--instanced] [--batch instances [--frames n] [--input script]... [--history n [--rewind frame]] [--save-state|--check-state file]] rom.nes\n", argv[0]);
+    return 1;
+  }
+
+  initializeBackend();
+
+  boost::iostreams::mapped_file file(argv[optind]);
 
   NesMachineSpec *machine;
   if(!(machine = loadNesMachine((const word *)file.data()))) {
@@ -35,37 +205,139 @@ int main(int argc, char **argv) {
 
   // std::cout << std::hex << (int)machine->readWord(address) << std::endl;
 
-  std::set<addr> functions;
-  findReachableFunctions(address, *machine, functions);
+  // Interrupt handlers are roots of their own; IRQ shares the BRK vector.
+  // Vectors that point outside PRG-ROM are left to the interpreter.
+  AddrSet roots;
+  roots.insert(address);
+  for (addr vector : {machine->getNMIAddr(), machine->getBRKAddr()}) {
+    if (vector >= machine->getPrgRomOffset()) {
+      roots.insert(vector);
+    }
+  }
 
-  ModuleGenerator modgen("mymod", *machine);
-  machine->writeLLVMHeader(modgen);
+  Program program(*machine);
+  findReachableFunctions(roots, program);
+  const AddrSet &functions = program.getFunctions();
 
-  for (auto funcStart : functions) {
-    declareFunction(funcStart, (funcStart == address), modgen);
-  }
+  if (!run) {
+    for (auto funcStart : functions) {
+      const FunctionInfo &function = program.getFunction(funcStart);
+      for (auto instAddress : function.instructions) {
+        if (function.blocks.count(instAddress)) {
+          std::cout << "-- ";
+        } else {
+          std::cout << "   ";
+        }
 
-  for (auto funcStart : functions) {
-    std::set<addr> function;
-    std::set<addr> blocks;
-    identifyFunction(funcStart, *machine, function);
-    identifyBlocks(funcStart, function, *machine, blocks);
-    for (std::set<addr>::iterator it = function.begin(); it != function.end(); it++) {
-      if (blocks.count(*it)) {
-        std::cout << "-- ";
-      } else {
-        std::cout << "   ";
+        std::cout << program.getInstruction(instAddress) << std::endl;
       }
-
-      std::unique_ptr<Instruction> inst(readInstruction(*it, *machine));
-      std::cout << *inst << std::endl;
+      std::cout << std::endl;
     }
-    std::cout << std::endl;
+  }
 
-    writeFunction(funcStart, modgen);
+  llvm::LLVMContext context;
+  std::unique_ptr<llvm::Module> module = generateModule(program, roots, options, context);
+  if (!module) {
+    return 1;
   }
 
-  modgen.write();
+  optimizeModule(*module, options.optLevel);
+
+  if (run) {
+    NesRuntime runtime(*machine);
+    Jit jit(runtime);
+    if (!jit.addModule(std::move(module))) {
+      return 1;
+    }
+
+    DispatchTable &natives = runtime.getDispatchTable();
+    AddrSet transferSafe;
+    for (auto funcStart : functions) {
+      natives.insert(funcStart, jit.getEntryPoint(funcStart));
+      if (!hasFallback(funcStart, program)) {
+        transferSafe.insert(funcStart);
+      }
+    }
+
+    runtime.getInterpreter().setNativeTier(
+      [&](addr start, bool transfer) -> EntryPoint {
+        if (transfer && !transferSafe.count(start)) {
+          return NULL;
+        }
+        return natives.lookup(start);
+      },
+      [&](addr start) {
+        if (start < machine->getPrgRomOffset() || program.hasFunction(start)) {
+          return;
+        }
+
+        findReachableFunctions(start, program);
+        Shard shard;
+        for (auto funcStart : program.getFunctions()) {
+          if (!natives.lookup(funcStart)) {
+            shard.push_back(funcStart);
+          }
+        }
+
+        std::unique_ptr<llvm::Module> incremental = generateIncrementalModule(shard, program, options, context);
+        optimizeModule(*incremental, options.optLevel);
+        if (!jit.addModule(std::move(incremental))) {
+          return;
+        }
+
+        for (auto funcStart : shard) {
+          natives.insert(funcStart, jit.getEntryPoint(funcStart));
+          if (!hasFallback(funcStart, program)) {
+            transferSafe.insert(funcStart);
+          }
+        }
+      });
+
+    if (batch.instances) {
+      batch.workers = options.jobs;
+      BatchExecutor executor(*machine, jit.getEntryPoint(address), [&](addr start, bool transfer) -> EntryPoint {
+        if (transfer && !transferSafe.count(start)) {
+          return NULL;
+        }
+        return natives.lookup(start);
+      }, batch);
+      for (unsigned i = 0; i < batch.instances && !inputs.empty(); i++) {
+        executor.setInputScript(i, inputs[i % inputs.size()]);
+      }
+
+      // Every instance snapshots at each frame boundary and, with --rewind,
+      // goes back through its whole history once it reaches that frame, so
+      // the rest of the run replays frames it has already been through.
+      std::vector<char> rewound(batch.instances, false);
+      if (batch.historySize) {
+        executor.setFrameHook([&](unsigned instance, uint64_t frame, NesRuntime &) {
+          if (rewindFrame && frame == rewindFrame && !rewound[instance]) {
+            rewound[instance] = true;
+            if (!executor.rollback(instance, batch.historySize - 1)) {
+              fprintf(stderr, "Instance %u has fewer than %u snapshots at frame %llu\n",
+                instance, batch.historySize, (unsigned long long)frame);
+            }
+            return;
+          }
+          executor.snapshot(instance);
+        });
+      }
+      printBatchReport(executor.run(), std::cerr);
+
+      if (saveState && !saveBatchStates(executor, batch.instances, saveState)) {
+        fprintf(stderr, "Could not write states to %s\n", saveState);
+        return 1;
+      }
+      if (checkState && !checkBatchStates(executor, batch.instances, checkState)) {
+        return 1;
+      }
+    } else {
+      RegisterState regs = {0, 0, 0, 0, 0, 0, 0};
+      runtime.enter(jit.getEntryPoint(address), regs);
+    }
+  } else if (!writeModule(*module, output)) {
+    return 1;
+  }
 
   delete machine;
   return 0;
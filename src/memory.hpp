@@ -6,3 +6,8 @@ typedef uint8_t word;
 typedef uint16_t addr;
 
 const addr ADDR_MAX = 65535;
+const addr ZERO_PAGE_END = 0x00FF;
+
+const addr PRG_ROM_START = 0x8000;
+const unsigned RAM_SIZE = 0x0800;
+const unsigned PRG_RAM_SIZE = 0x2000;
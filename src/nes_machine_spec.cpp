@@ -1,5 +1,6 @@
 #include "nes_machine_spec.hpp"
 
+#include <cstddef>
 #include <cstring>
 
 #include <vector>
@@ -8,25 +9,74 @@ using std::vector;
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 using llvm::Type;
 using llvm::ArrayType;
 using llvm::FunctionType;
+using llvm::PointerType;
 using llvm::GlobalVariable;
 using llvm::GlobalValue;
 using llvm::Module;
 using llvm::IRBuilder;
 using llvm::Value;
-using llvm::getGlobalContext;
 using llvm::Constant;
 using llvm::APInt;
 using llvm::ConstantAggregateZero;
+using llvm::ConstantDataArray;
 using llvm::ArrayRef;
 using llvm::Function;
+using llvm::BasicBlock;
+using llvm::ConstantInt;
+using llvm::PHINode;
+using llvm::MDNode;
+using llvm::MDBuilder;
+using llvm::LLVMContext;
+using llvm::StructType;
 
 #include "codegen.hpp"
+#include "runtime.hpp"
+#include "value_range.hpp"
 
 const char *NES_IDENTIFIER = "NES\x1a";
 
+const uint32_t INLINE_WEIGHT = 2000;
+const uint32_t HANDLER_WEIGHT = 1;
+
+const word FLAG_BATTERY = 0x02;
+
+const char *RAM_ARRAY = "ram";
+const char *PRG_RAM_ARRAY = "prg_ram";
+const char *PRG_ROM_ARRAY = "prg_rom";
+const char *PENDING_ENTRY = "pending_entry";
+const char *CYCLE_BUDGET = "cycle_budget";
+
+const char *TBAA_ROOT = "nes memory";
+
+struct MemoryArea {
+  addr start;
+  addr end;
+  const char *name;
+};
+
+// Conventional uses of internal RAM. Accesses known to stay within one
+// area are tagged so the optimizer can tell them apart.
+const MemoryArea RAM_AREAS[] = {
+  {0x0000, 0x00FF, "zero page"},
+  {0x0100, 0x01FF, "stack"},
+  {0x0200, 0x02FF, "oam shadow"},
+  {0x0300, 0x07FF, "work ram"}
+};
+
+// CPU address space. Addresses are mirrored within a region by masking;
+// RAM and ROM are accessed inline, I/O registers through the runtime.
+const MemoryRegion NES_MEMORY_MAP[] = {
+  {0x0000, 0x1FFF, RAM_SIZE - 1, REGION_RAM, RAM_ARRAY},
+  {0x2000, 0x3FFF, 0x2007, REGION_IO, NULL},
+  {0x4000, 0x5FFF, 0xFFFF, REGION_IO, NULL},
+  {0x6000, 0x7FFF, PRG_RAM_SIZE - 1, REGION_RAM, PRG_RAM_ARRAY},
+  {0x8000, 0xFFFF, 0xFFFF, REGION_ROM, PRG_ROM_ARRAY}
+};
+
 typedef struct {
   char identifier[4];
   uint8_t prgRomSize;
@@ -56,6 +106,17 @@ NesMachineSpec *loadNesMachine(const word *buffer) {
   result->prgRomOffset = ADDR_MAX - result->prgRomSize + 1;
   result->prgRom = buffer;
 
+  // Carts without PRG-RAM leave $6000-$7FFF to the runtime, like the
+  // other unmapped addresses.
+  result->prgRam = (header->flags1 & FLAG_BATTERY) || header->ramSize != 0;
+  for (auto &region : NES_MEMORY_MAP) {
+    result->memoryMap.push_back(region);
+    if (!result->prgRam && region.array == PRG_RAM_ARRAY) {
+      result->memoryMap.back().kind = REGION_IO;
+      result->memoryMap.back().array = NULL;
+    }
+  }
+
   return result;
 }
 
@@ -71,70 +132,438 @@ const word *NesMachineSpec::getPrgRom() const {
   return prgRom;
 }
 
+bool NesMachineSpec::hasPrgRam() const {
+  return prgRam;
+}
+
+const MemoryRegion &NesMachineSpec::findRegion(addr address) const {
+  unsigned i = 0;
+  while (address > memoryMap[i].end) {
+    i++;
+  }
+  return memoryMap[i];
+}
+
+// The offsets into a region's array that addresses in the range map to,
+// or an empty range if none do.
+ValueRange getRegionOffsets(const MemoryRegion &region, const ValueRange &range) {
+  ValueRange result = {std::max<uint32_t>(range.low, region.start), std::min<uint32_t>(range.high, region.end)};
+  if (result.low > result.high) {
+    return result;
+  }
+
+  if (result.high - result.low < region.mask && (result.low & region.mask) <= (result.high & region.mask)) {
+    result.low &= region.mask;
+    result.high &= region.mask;
+  } else {
+    result.low = 0;
+    result.high = region.mask;
+  }
+  return result;
+}
+
+// Whether an access may reach a zero-page word, directly or through one of
+// its mirrors, and so has to see the values of promoted words in memory.
+bool NesMachineSpec::mayAliasZeroPage(const ValueRange &range) const {
+  ValueRange offsets = getRegionOffsets(findRegion(0), range);
+  return offsets.low <= offsets.high && offsets.low <= ZERO_PAGE_END;
+}
+
+bool NesMachineSpec::isZeroPageMirror(addr address) const {
+  const MemoryRegion &region = findRegion(0);
+  return address <= region.end && address > ZERO_PAGE_END && (address & region.mask) <= ZERO_PAGE_END;
+}
+
+addr NesMachineSpec::getPrgRomIndex(addr address) const {
+  return (addr)(address - prgRomOffset) & (addr)(prgRomSize - 1);
+}
+
 word NesMachineSpec::readWord(addr address) const {
-  if (address >= prgRomOffset) {
-    return prgRom[address - prgRomOffset];
+  if (isReadOnly(address)) {
+    return prgRom[getPrgRomIndex(address)];
   }
 
   return 0;
 }
 
+bool NesMachineSpec::isReadOnly(addr address) const {
+  return address >= PRG_ROM_START;
+}
+
+// Memory and PPU status only change at events the runtime can skip to, and
+// reading them again changes nothing a spinning loop would notice.
+bool NesMachineSpec::isIdleRead(addr address) const {
+  const MemoryRegion &region = findRegion(address);
+  return region.kind != REGION_IO || (address & region.mask) == 0x2002;
+}
+
+// Layout of MachineState in the runtime, which instanced code addresses
+// through its state pointer instead of the ram and prg_ram globals.
+StructType *getStateType(LLVMContext &context) {
+  Type *bytePtrType = Type::getInt8PtrTy(context);
+  Type *fields[] = {ArrayType::get(Type::getInt8Ty(context), RAM_SIZE), bytePtrType, bytePtrType, bytePtrType, Type::getInt32Ty(context)};
+  return StructType::get(context, fields);
+}
+
+static_assert(offsetof(MachineState, prgRam) == RAM_SIZE &&
+  offsetof(MachineState, runtime) == RAM_SIZE + sizeof(void *) &&
+  offsetof(MachineState, pendingEntry) == RAM_SIZE + 2 * sizeof(void *) &&
+  offsetof(MachineState, cycleBudget) == RAM_SIZE + 3 * sizeof(void *),
+  "getStateType does not match MachineState");
+
 void NesMachineSpec::writeLLVMHeader(ModuleGenerator &modgen) const {
-  ArrayType *ramType = ArrayType::get(modgen.getWordType(), 65536);
-  GlobalVariable *ram = new GlobalVariable(modgen.getModule(), ramType, false, GlobalValue::ExternalLinkage, NULL, "ram");
-  ConstantAggregateZero* ramInit = ConstantAggregateZero::get(ramType);
-  ram->setInitializer(ramInit);
+  if (!modgen.isInstanced()) {
+    ArrayType *ramType = ArrayType::get(modgen.getWordType(), RAM_SIZE);
+    GlobalVariable *ram = new GlobalVariable(modgen.getModule(), ramType, false, GlobalValue::CommonLinkage, NULL, RAM_ARRAY);
+    ConstantAggregateZero* ramInit = ConstantAggregateZero::get(ramType);
+    ram->setInitializer(ramInit);
+  }
+
+  if (!modgen.isInstanced()) {
+    Type *budgetType = Type::getInt32Ty(modgen.getContext());
+    GlobalVariable *budget = new GlobalVariable(modgen.getModule(), budgetType, false, GlobalValue::CommonLinkage, NULL, CYCLE_BUDGET);
+    budget->setInitializer(Constant::getNullValue(budgetType));
+  }
+
+  if (prgRam && !modgen.isInstanced()) {
+    ArrayType *prgRamType = ArrayType::get(modgen.getWordType(), PRG_RAM_SIZE);
+    GlobalVariable *prgRamGlobal = new GlobalVariable(modgen.getModule(), prgRamType, false, GlobalValue::CommonLinkage, NULL, PRG_RAM_ARRAY);
+    prgRamGlobal->setInitializer(ConstantAggregateZero::get(prgRamType));
+  }
+
+  ArrayType *prgRomType = ArrayType::get(modgen.getWordType(), prgRomSize);
+  new GlobalVariable(modgen.getModule(), prgRomType, true, GlobalValue::ExternalLinkage, NULL, PRG_ROM_ARRAY);
 
   vector<Type *> args;
   args.push_back(modgen.getWordType());
-  FunctionType *wfType = FunctionType::get(Type::getVoidTy(getGlobalContext()), args, false);
+  FunctionType *wfType = FunctionType::get(Type::getVoidTy(modgen.getContext()), args, false);
 
   args.clear();
   FunctionType *rfType = FunctionType::get(modgen.getWordType(), args, false);
 
-  Function::Create(rfType, Function::ExternalLinkage, "readPPUStatus", &(modgen.getModule()));
+  modgen.declareHook("readPPUStatus", rfType);
+
+  modgen.declareHook("writePPUScroll", wfType);
+  modgen.declareHook("writePPUCtrl", wfType);
+  modgen.declareHook("writePPUAddr", wfType);
+  modgen.declareHook("writePPUData", wfType);
+
+  args.clear();
+  args.push_back(modgen.getAddrType());
+  FunctionType *rmType = FunctionType::get(modgen.getWordType(), args, false);
+  args.push_back(modgen.getWordType());
+  FunctionType *wmType = FunctionType::get(Type::getVoidTy(modgen.getContext()), args, false);
+
+  modgen.declareHook("readMemory", rmType);
+  modgen.declareHook("writeMemory", wmType);
 
-  Function::Create(wfType, Function::ExternalLinkage, "writePPUScroll", &(modgen.getModule()));
-  Function::Create(wfType, Function::ExternalLinkage, "writePPUCtrl", &(modgen.getModule()));
-  Function::Create(wfType, Function::ExternalLinkage, "writePPUAddr", &(modgen.getModule()));
-  Function::Create(wfType, Function::ExternalLinkage, "writePPUData", &(modgen.getModule()));
+  args.clear();
+  args.push_back(modgen.getAddrType());
+  args.push_back(PointerType::getUnqual(modgen.getRegStructType()));
+  FunctionType *ifType = FunctionType::get(Type::getVoidTy(modgen.getContext()), args, false);
+  FunctionType *dfType = FunctionType::get(PointerType::getUnqual(modgen.getEntryType()), ifType->params(), false);
+
+  args.clear();
+  args.push_back(PointerType::getUnqual(modgen.getRegStructType()));
+  FunctionType *tfType = FunctionType::get(Type::getVoidTy(modgen.getContext()), args, false);
+
+  modgen.declareHook("interpret", ifType);
+  modgen.declareHook("dispatch", dfType);
+  modgen.declareHook("trampoline", tfType);
+
+  args.clear();
+  FunctionType *pollType = FunctionType::get(Type::getVoidTy(modgen.getContext()), args, false);
+  modgen.declareHook("poll", pollType);
+  modgen.declareHook("waitForEvent", pollType);
+
+  if (!modgen.isInstanced()) {
+    new GlobalVariable(modgen.getModule(), PointerType::getUnqual(modgen.getEntryType()), false, GlobalValue::ExternalLinkage, NULL, PENDING_ENTRY);
+  }
+}
+
+// Shards only declare the ROM image, so cached bitcode never carries a
+// stale copy of it. The module they end up in defines it once.
+void NesMachineSpec::writeLLVMDefinitions(Module &module) const {
+  GlobalVariable *prgRomGlobal = module.getGlobalVariable(PRG_ROM_ARRAY);
+  ArrayRef<uint8_t> prgRomData(prgRom, prgRomSize);
+  prgRomGlobal->setInitializer(ConstantDataArray::get(module.getContext(), prgRomData));
+  prgRomGlobal->setLinkage(GlobalValue::LinkOnceODRLinkage);
+  prgRomGlobal->setUnnamedAddr(true);
 }
 
 Value *callReadFunc(const char *name, BlockGenerator &blockgen) {
-  Function *func = blockgen.getModule().getFunction(name);
-  blockgen.getBuilder().CreateCall(func, ArrayRef<Value *>());
+  return blockgen.createHookCall(name, ArrayRef<Value *>());
+}
+
+void callStoreFunc(const char *name, Value *value, BlockGenerator &blockgen) {
+  blockgen.createHookCall(name, ArrayRef<Value *>(&value, 1));
+}
+
+Value *getArrayPtr(const char *name, Value *index, BlockGenerator &blockgen) {
+  IRBuilder<> &builder = blockgen.getBuilder();
+  Value *zero = builder.getInt32(0);
+  if (!blockgen.isInstanced() || name == PRG_ROM_ARRAY) {
+    Value *array = blockgen.getModule().getGlobalVariable(name, true);
+    Value *indexList[2] = {blockgen.getConstant((addr)0), index};
+    return builder.CreateGEP(array, ArrayRef<Value *>(indexList, 2));
+  }
+
+  StructType *stateType = getStateType(blockgen.getContext());
+  Value *state = builder.CreateBitCast(blockgen.getStatePointer(), PointerType::getUnqual(stateType));
+  if (name == RAM_ARRAY) {
+    Value *indexList[3] = {zero, zero, index};
+    return builder.CreateGEP(state, ArrayRef<Value *>(indexList, 3));
+  }
+
+  Value *array = builder.CreateLoad(builder.CreateStructGEP(state, 1));
+  return builder.CreateGEP(array, index);
+}
+
+Value *NesMachineSpec::getPendingEntryPtr(BlockGenerator &blockgen) const {
+  IRBuilder<> &builder = blockgen.getBuilder();
+  if (!blockgen.isInstanced()) {
+    return blockgen.getModule().getGlobalVariable(PENDING_ENTRY);
+  }
+
+  StructType *stateType = getStateType(blockgen.getContext());
+  Value *state = builder.CreateBitCast(blockgen.getStatePointer(), PointerType::getUnqual(stateType));
+  Type *entryPtrType = PointerType::getUnqual(blockgen.getEntryType());
+  return builder.CreateBitCast(builder.CreateStructGEP(state, 3), PointerType::getUnqual(entryPtrType));
+}
+
+Value *getCycleBudgetPtr(BlockGenerator &blockgen) {
+  if (!blockgen.isInstanced()) {
+    return blockgen.getModule().getGlobalVariable(CYCLE_BUDGET, true);
+  }
+
+  IRBuilder<> &builder = blockgen.getBuilder();
+  StructType *stateType = getStateType(blockgen.getContext());
+  Value *state = builder.CreateBitCast(blockgen.getStatePointer(), PointerType::getUnqual(stateType));
+  return builder.CreateStructGEP(state, 4);
+}
+
+Value *getRegionCheck(const MemoryRegion &region, Value *address, BlockGenerator &blockgen) {
+  IRBuilder<> &builder = blockgen.getBuilder();
+  if (region.start == 0) {
+    return builder.CreateICmpULE(address, blockgen.getConstant(region.end));
+  } else if (region.end == ADDR_MAX) {
+    return builder.CreateICmpUGE(address, blockgen.getConstant(region.start));
+  }
+  Value *offset = builder.CreateSub(address, blockgen.getConstant(region.start));
+  return builder.CreateICmpULE(offset, blockgen.getConstant((addr)(region.end - region.start)));
+}
+
+bool overlapsRegion(const MemoryRegion &region, const ValueRange &range) {
+  return range.low <= region.end && range.high >= region.start;
+}
+
+bool needsHandler(const MemoryRegion &region, bool store) {
+  return region.kind == REGION_IO || (store && region.kind == REGION_ROM);
+}
+
+// Classifies the regions an access may touch, given the range of its
+// address, into those needing the runtime handler and those accessed inline.
+void classifyAccess(const vector<MemoryRegion> &memoryMap, const ValueRange &range, bool store, bool &mayUseHandler, bool &mayBeInline) {
+  mayUseHandler = false;
+  mayBeInline = false;
+  for (auto &region : memoryMap) {
+    if (overlapsRegion(region, range)) {
+      if (needsHandler(region, store)) {
+        mayUseHandler = true;
+      } else {
+        mayBeInline = true;
+      }
+    }
+  }
+}
+
+Value *getHandlerCheck(const vector<MemoryRegion> &memoryMap, const ValueRange &range, bool store, Value *address, BlockGenerator &blockgen) {
+  Value *result = NULL;
+  for (auto &region : memoryMap) {
+    if (needsHandler(region, store) && overlapsRegion(region, range)) {
+      Value *check = getRegionCheck(region, address, blockgen);
+      result = result ? blockgen.getBuilder().CreateOr(result, check) : check;
+    }
+  }
+  return result;
+}
+
+Value *NesMachineSpec::getRegionPtr(const MemoryRegion &region, Value *address, BlockGenerator &blockgen) const {
+  IRBuilder<> &builder = blockgen.getBuilder();
+  if (region.kind == REGION_ROM) {
+    Value *offset = builder.CreateSub(address, blockgen.getConstant(prgRomOffset));
+    Value *index = builder.CreateAnd(offset, blockgen.getConstant((addr)(prgRomSize - 1)));
+    return getArrayPtr(region.array, index, blockgen);
+  }
+  return getArrayPtr(region.array, builder.CreateAnd(address, blockgen.getConstant(region.mask)), blockgen);
+}
+
+MDNode *NesMachineSpec::getAccessTag(const ValueRange &range, bool store, LLVMContext &context) const {
+  MDBuilder builder(context);
+  MDNode *type = builder.createTBAARoot(TBAA_ROOT);
+
+  const MemoryRegion *only = NULL;
+  for (auto &region : memoryMap) {
+    if (!needsHandler(region, store) && overlapsRegion(region, range)) {
+      if (only) {
+        return builder.createTBAAStructTagNode(type, type, 0);
+      }
+      only = &region;
+    }
+  }
+
+  type = builder.createTBAAScalarTypeNode(only->array, type);
+  if (only->array == RAM_ARRAY) {
+    ValueRange offsets = getRegionOffsets(*only, range);
+    for (auto &area : RAM_AREAS) {
+      if (offsets.low >= area.start && offsets.high <= area.end) {
+        type = builder.createTBAAScalarTypeNode(area.name, type);
+        break;
+      }
+    }
+  }
+  return builder.createTBAAStructTagNode(type, type, 0);
+}
+
+Value *NesMachineSpec::generateInlineLoad(const ValueRange &range, Value *address, BlockGenerator &blockgen) const {
+  llvm::LoadInst *load = blockgen.getBuilder().CreateLoad(getInlinePtr(range, false, address, blockgen));
+  load->setMetadata(LLVMContext::MD_tbaa, getAccessTag(range, false, blockgen.getContext()));
+  return load;
+}
+
+void NesMachineSpec::generateInlineStore(const ValueRange &range, Value *address, Value *value, BlockGenerator &blockgen) const {
+  llvm::StoreInst *store = blockgen.getBuilder().CreateStore(value, getInlinePtr(range, true, address, blockgen));
+  store->setMetadata(LLVMContext::MD_tbaa, getAccessTag(range, true, blockgen.getContext()));
+}
+
+// Selects the pointer for whichever inline region the address falls in,
+// so that the fast path is a single load or store.
+Value *NesMachineSpec::getInlinePtr(const ValueRange &range, bool store, Value *address, BlockGenerator &blockgen) const {
+  Value *result = NULL;
+  for (auto it = memoryMap.rbegin(); it != memoryMap.rend(); ++it) {
+    const MemoryRegion &region = *it;
+    if (needsHandler(region, store) || !overlapsRegion(region, range)) {
+      continue;
+    }
+    Value *ptr = getRegionPtr(region, address, blockgen);
+    if (result) {
+      result = blockgen.getBuilder().CreateSelect(getRegionCheck(region, address, blockgen), ptr, result);
+    } else {
+      result = ptr;
+    }
+  }
+  return result;
 }
 
 Value *NesMachineSpec::generateLoad(addr address, BlockGenerator &blockgen) const {
-  switch(address) {
+  const MemoryRegion &region = findRegion(address);
+  ValueRange range = {address, address};
+  switch (region.kind) {
+    case REGION_ROM:
+      return blockgen.getConstant(readWord(address));
+    case REGION_RAM:
+      if (isZeroPageMirror(address)) {
+        blockgen.spillPromotedWords();
+      }
+      return generateInlineLoad(range, blockgen.getConstant(address), blockgen);
+    default:
+      break;
+  }
+
+  blockgen.spillPromotedWords();
+  switch (address & region.mask) {
     case 0x2002:
       return callReadFunc("readPPUStatus", blockgen);
-    default:
-      IRBuilder<> &builder = blockgen.getBuilder();
-      Value *ram = blockgen.getModule().getGlobalVariable("ram", false);
-      Value *offset = blockgen.getConstant(address);
-      Value *indexList[2] = {blockgen.getConstant((addr)0), offset};
-      Value *ptr = builder.CreateGEP(ram, ArrayRef<Value *>(indexList, 2));
-      return builder.CreateLoad(ptr);
-  };
+    default: {
+      Value *arg = blockgen.getConstant(address);
+      return blockgen.createHookCall("readMemory", ArrayRef<Value *>(&arg, 1));
+    }
+  }
 }
 
 Value *NesMachineSpec::generateLoad(Value *address, BlockGenerator &blockgen) const {
-  // TODO
+  ValueRange range = getValueRange(address);
+  if (mayAliasZeroPage(range)) {
+    blockgen.spillPromotedWords();
+  }
+
+  if (ConstantInt *constant = llvm::dyn_cast<ConstantInt>(address)) {
+    return generateLoad((addr)constant->getZExtValue(), blockgen);
+  }
+
   IRBuilder<> &builder = blockgen.getBuilder();
-  Value *ram = blockgen.getModule().getGlobalVariable("ram", false);
-  Value *indexList[2] = {blockgen.getConstant((addr)0), address};
-  Value *ptr = builder.CreateGEP(ram, ArrayRef<Value *>(indexList, 2));
-  return builder.CreateLoad(ptr);
+  bool mayUseHandler, mayBeInline;
+  classifyAccess(memoryMap, range, false, mayUseHandler, mayBeInline);
+  if (mayUseHandler) {
+    blockgen.spillPromotedWords();
+  }
+
+  if (!mayUseHandler) {
+    return generateInlineLoad(range, address, blockgen);
+  } else if (!mayBeInline) {
+    return blockgen.createHookCall("readMemory", ArrayRef<Value *>(&address, 1));
+  }
+
+  LLVMContext &context = blockgen.getContext();
+  Function *func = builder.GetInsertBlock()->getParent();
+  BasicBlock *handlerBlock = BasicBlock::Create(context, "load_io", func);
+  BasicBlock *inlineBlock = BasicBlock::Create(context, "load", func);
+  BasicBlock *doneBlock = BasicBlock::Create(context, "load_done", func);
+
+  MDNode *weights = MDBuilder(context).createBranchWeights(HANDLER_WEIGHT, INLINE_WEIGHT);
+  builder.CreateCondBr(getHandlerCheck(memoryMap, range, false, address, blockgen), handlerBlock, inlineBlock, weights);
+
+  builder.SetInsertPoint(handlerBlock);
+  Value *handlerValue = blockgen.createHookCall("readMemory", ArrayRef<Value *>(&address, 1));
+  builder.CreateBr(doneBlock);
+
+  builder.SetInsertPoint(inlineBlock);
+  Value *inlineValue = generateInlineLoad(range, address, blockgen);
+  builder.CreateBr(doneBlock);
+
+  builder.SetInsertPoint(doneBlock);
+  PHINode *result = builder.CreatePHI(blockgen.getWordType(), 2);
+  result->addIncoming(handlerValue, handlerBlock);
+  result->addIncoming(inlineValue, inlineBlock);
+  return result;
 }
 
-void callStoreFunc(const char *name, Value *value, BlockGenerator &blockgen) {
-  Function *func = blockgen.getModule().getFunction(name);
-  blockgen.getBuilder().CreateCall(func, ArrayRef<Value *>(&value, 1));
+Value *NesMachineSpec::generateIndexedLoad(addr base, Value *index, BlockGenerator &blockgen) const {
+  IRBuilder<> &builder = blockgen.getBuilder();
+  Value *address = builder.CreateAdd(blockgen.getConstant(base), index);
+
+  // Tables that lie entirely within PRG ROM are read from the constant
+  // copy, so the optimizer can fold lookups with a known index.
+  const MemoryRegion &region = findRegion(base);
+  if (region.kind == REGION_ROM && base <= region.end - 0xFF) {
+    ValueRange range = {base, (uint32_t)base + 0xFF};
+    return generateInlineLoad(range, address, blockgen);
+  }
+
+  return generateLoad(address, blockgen);
 }
 
 void NesMachineSpec::generateStore(addr address, Value *value, BlockGenerator &blockgen) const {
-  switch(address) {
+  const MemoryRegion &region = findRegion(address);
+  ValueRange range = {address, address};
+  switch (region.kind) {
+    case REGION_ROM:
+      return;
+    case REGION_RAM:
+      if (isZeroPageMirror(address)) {
+        blockgen.spillPromotedWords();
+        generateInlineStore(range, blockgen.getConstant(address), value, blockgen);
+        blockgen.reloadPromotedWords();
+      } else {
+        generateInlineStore(range, blockgen.getConstant(address), value, blockgen);
+      }
+      return;
+    default:
+      break;
+  }
+
+  blockgen.spillPromotedWords();
+  switch (address & region.mask) {
     case 0x2000:
       callStoreFunc("writePPUCtrl", value, blockgen);
       break;
@@ -147,21 +576,107 @@ void NesMachineSpec::generateStore(addr address, Value *value, BlockGenerator &b
     case 0x2007:
       callStoreFunc("writePPUData", value, blockgen);
       break;
-    default:
-      IRBuilder<> &builder = blockgen.getBuilder();
-      Value *ram = blockgen.getModule().getGlobalVariable("ram", true);
-      Value *offset = blockgen.getConstant(address);
-      Value *indexList[2] = {blockgen.getConstant((addr)0), offset};
-      Value *ptr = builder.CreateGEP(ram, ArrayRef<Value *>(indexList, 2));
-      builder.CreateStore(value, ptr);
-  };
+    default: {
+      Value *args[2] = {blockgen.getConstant(address), value};
+      blockgen.createHookCall("writeMemory", ArrayRef<Value *>(args, 2));
+    }
+  }
 }
 
 void NesMachineSpec::generateStore(Value *address, llvm::Value *value, BlockGenerator &blockgen) const {
-  // TODO
+  ValueRange range = getValueRange(address);
+  if (mayAliasZeroPage(range)) {
+    blockgen.spillPromotedWords();
+    generateUncheckedStore(range, address, value, blockgen);
+    blockgen.reloadPromotedWords();
+  } else {
+    generateUncheckedStore(range, address, value, blockgen);
+  }
+}
+
+void NesMachineSpec::generateUncheckedStore(const ValueRange &range, Value *address, Value *value, BlockGenerator &blockgen) const {
+  if (ConstantInt *constant = llvm::dyn_cast<ConstantInt>(address)) {
+    generateStore((addr)constant->getZExtValue(), value, blockgen);
+    return;
+  }
+
+  IRBuilder<> &builder = blockgen.getBuilder();
+  bool mayUseHandler, mayBeInline;
+  classifyAccess(memoryMap, range, true, mayUseHandler, mayBeInline);
+  if (mayUseHandler) {
+    blockgen.spillPromotedWords();
+  }
+
+  Value *args[2] = {address, value};
+  if (!mayUseHandler) {
+    generateInlineStore(range, address, value, blockgen);
+    return;
+  } else if (!mayBeInline) {
+    blockgen.createHookCall("writeMemory", ArrayRef<Value *>(args, 2));
+    return;
+  }
+
+  LLVMContext &context = blockgen.getContext();
+  Function *func = builder.GetInsertBlock()->getParent();
+  BasicBlock *handlerBlock = BasicBlock::Create(context, "store_io", func);
+  BasicBlock *inlineBlock = BasicBlock::Create(context, "store", func);
+  BasicBlock *doneBlock = BasicBlock::Create(context, "store_done", func);
+
+  MDNode *weights = MDBuilder(context).createBranchWeights(HANDLER_WEIGHT, INLINE_WEIGHT);
+  builder.CreateCondBr(getHandlerCheck(memoryMap, range, true, address, blockgen), handlerBlock, inlineBlock, weights);
+
+  builder.SetInsertPoint(handlerBlock);
+  blockgen.createHookCall("writeMemory", ArrayRef<Value *>(args, 2));
+  builder.CreateBr(doneBlock);
+
+  builder.SetInsertPoint(inlineBlock);
+  generateInlineStore(range, address, value, blockgen);
+  builder.CreateBr(doneBlock);
+
+  builder.SetInsertPoint(doneBlock);
+}
+
+// The runtime hands out a budget of cycles until its next event, such as
+// vblank, and sets it to zero when an interrupt becomes pending, so a
+// single counter serves as both the clock and the pending flag.
+void NesMachineSpec::generateInterruptPoll(unsigned cycles, BlockGenerator &blockgen) const {
   IRBuilder<> &builder = blockgen.getBuilder();
-  Value *ram = blockgen.getModule().getGlobalVariable("ram", true);
-  Value *indexList[2] = {blockgen.getConstant((addr)0), address};
-  Value *ptr = builder.CreateGEP(ram, ArrayRef<Value *>(indexList, 2));
-  builder.CreateStore(value, ptr);
+  LLVMContext &context = blockgen.getContext();
+  Function *func = builder.GetInsertBlock()->getParent();
+
+  Value *budgetPtr = getCycleBudgetPtr(blockgen);
+  Value *budget = builder.CreateSub(builder.CreateLoad(budgetPtr), builder.getInt32(cycles));
+  builder.CreateStore(budget, budgetPtr);
+
+  BasicBlock *pollBlock = BasicBlock::Create(context, "poll", func);
+  BasicBlock *doneBlock = BasicBlock::Create(context, "poll_done", func);
+  MDNode *weights = MDBuilder(context).createBranchWeights(HANDLER_WEIGHT, INLINE_WEIGHT);
+  builder.CreateCondBr(builder.CreateICmpSLE(budget, builder.getInt32(0)), pollBlock, doneBlock, weights);
+
+  builder.SetInsertPoint(pollBlock);
+  blockgen.spillPromotedWords();
+  blockgen.createHookCall("poll", ArrayRef<Value *>());
+  blockgen.reloadPromotedWords();
+  builder.CreateBr(doneBlock);
+
+  builder.SetInsertPoint(doneBlock);
+}
+
+// Skips ahead to the next PPU event instead of spinning until it happens.
+void NesMachineSpec::generateIdleWait(Value *waiting, BlockGenerator &blockgen) const {
+  IRBuilder<> &builder = blockgen.getBuilder();
+  LLVMContext &context = blockgen.getContext();
+  Function *func = builder.GetInsertBlock()->getParent();
+
+  BasicBlock *waitBlock = BasicBlock::Create(context, "idle", func);
+  BasicBlock *doneBlock = BasicBlock::Create(context, "idle_done", func);
+  builder.CreateCondBr(waiting, waitBlock, doneBlock);
+
+  builder.SetInsertPoint(waitBlock);
+  blockgen.spillPromotedWords();
+  blockgen.createHookCall("waitForEvent", ArrayRef<Value *>());
+  blockgen.reloadPromotedWords();
+  builder.CreateBr(doneBlock);
+
+  builder.SetInsertPoint(doneBlock);
 }
@@ -1,28 +1,72 @@
 #pragma once
 
+#include <vector>
+
 #include "machine_spec.hpp"
 #include "memory.hpp"
 
+namespace llvm {
+  class LLVMContext;
+  class MDNode;
+}
+
+struct ValueRange;
+
+enum RegionKind {
+  REGION_RAM,
+  REGION_ROM,
+  REGION_IO
+};
+
+struct MemoryRegion {
+  addr start;
+  addr end;
+  addr mask;
+  RegionKind kind;
+  const char *array;
+};
+
 class NesMachineSpec : public MachineSpec {
   friend NesMachineSpec *loadNesMachine(const word *buffer);
 
   public:
-    addr getPrgRomSize() const;
-    addr getPrgRomOffset() const;
     const word *getPrgRom() const;
+    const MemoryRegion &findRegion(addr address) const;
 
   public:
     virtual word readWord(addr) const;
+    virtual bool isReadOnly(addr) const;
+    virtual addr getPrgRomSize() const;
+    virtual addr getPrgRomOffset() const;
+    virtual bool hasPrgRam() const;
+    virtual bool isIdleRead(addr) const;
     virtual void writeLLVMHeader(ModuleGenerator &modgen) const;
+    virtual void writeLLVMDefinitions(llvm::Module &module) const;
     virtual llvm::Value *generateLoad(addr address, BlockGenerator &blockgen) const;
     virtual llvm::Value *generateLoad(llvm::Value *address, BlockGenerator &blockgen) const;
+    virtual llvm::Value *generateIndexedLoad(addr base, llvm::Value *index, BlockGenerator &blockgen) const;
     virtual void generateStore(addr address, llvm::Value *value, BlockGenerator &blockgen) const;
     virtual void generateStore(llvm::Value *address, llvm::Value *value, BlockGenerator &blockgen) const;
+    virtual llvm::Value *getPendingEntryPtr(BlockGenerator &blockgen) const;
+    virtual void generateInterruptPoll(unsigned cycles, BlockGenerator &blockgen) const;
+    virtual void generateIdleWait(llvm::Value *waiting, BlockGenerator &blockgen) const;
 
   private:
+    addr getPrgRomIndex(addr address) const;
+    llvm::Value *getRegionPtr(const MemoryRegion &region, llvm::Value *address, BlockGenerator &blockgen) const;
+    llvm::Value *getInlinePtr(const ValueRange &range, bool store, llvm::Value *address, BlockGenerator &blockgen) const;
+    llvm::MDNode *getAccessTag(const ValueRange &range, bool store, llvm::LLVMContext &context) const;
+    llvm::Value *generateInlineLoad(const ValueRange &range, llvm::Value *address, BlockGenerator &blockgen) const;
+    void generateInlineStore(const ValueRange &range, llvm::Value *address, llvm::Value *value, BlockGenerator &blockgen) const;
+    bool mayAliasZeroPage(const ValueRange &range) const;
+    bool isZeroPageMirror(addr address) const;
+    void generateUncheckedStore(const ValueRange &range, llvm::Value *address, llvm::Value *value, BlockGenerator &blockgen) const;
+
     addr prgRomOffset;
     addr prgRomSize;
     const word *prgRom;
+    bool prgRam;
+    std::vector<MemoryRegion> memoryMap;
 };
 
 NesMachineSpec *loadNesMachine(const word *buffer);
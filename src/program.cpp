@@ -0,0 +1,48 @@
+#include "program.hpp"
+
+#include "machine_spec.hpp"
+
+Program::Program(const MachineSpec &machine) :
+  machine(machine)
+{}
+
+const MachineSpec &Program::getMachine() const {
+  return machine;
+}
+
+const DecodedInstruction &Program::decode(addr address) {
+  DecodedInstruction *instruction = instructions.find(address);
+  if (!instruction) {
+    instruction = &instructions[address];
+    *instruction = readInstruction(address, machine);
+  }
+  return *instruction;
+}
+
+const DecodedInstruction &Program::getInstruction(addr address) const {
+  return instructions.at(address);
+}
+
+FunctionInfo &Program::addFunction(addr start) {
+  functions.insert(start);
+  FunctionInfo &info = functionInfo[start];
+  info.start = start;
+  info.hasSignature = false;
+  return info;
+}
+
+bool Program::hasFunction(addr start) const {
+  return functions.count(start);
+}
+
+FunctionInfo &Program::getFunction(addr start) {
+  return functionInfo.at(start);
+}
+
+const FunctionInfo &Program::getFunction(addr start) const {
+  return functionInfo.at(start);
+}
+
+const AddrSet &Program::getFunctions() const {
+  return functions;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <map>
+
+#include "addr_map.hpp"
+#include "addr_set.hpp"
+#include "instruction.hpp"
+#include "memory.hpp"
+#include "registers.hpp"
+
+class MachineSpec;
+
+struct FunctionInfo {
+  addr start;
+  AddrSet instructions;
+  AddrSet blocks;
+  AddrSet callees;
+  FunctionSignature signature;
+  bool hasSignature;
+};
+
+class Program {
+  public:
+    Program(const MachineSpec &machine);
+
+    const MachineSpec &getMachine() const;
+    const DecodedInstruction &decode(addr address);
+    const DecodedInstruction &getInstruction(addr address) const;
+
+    FunctionInfo &addFunction(addr start);
+    bool hasFunction(addr start) const;
+    FunctionInfo &getFunction(addr start);
+    const FunctionInfo &getFunction(addr start) const;
+    const AddrSet &getFunctions() const;
+
+  private:
+    const MachineSpec &machine;
+    AddrMap<DecodedInstruction> instructions;
+    std::map<addr, FunctionInfo> functionInfo;
+    AddrSet functions;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+enum Register {
+  REG_A,
+  REG_X,
+  REG_Y,
+  REG_N,
+  REG_V,
+  REG_Z,
+  REG_C,
+  REG_COUNT
+};
+
+typedef uint8_t RegisterMask;
+
+const RegisterMask ALL_REGISTERS = (1 << REG_COUNT) - 1;
+
+inline RegisterMask registerBit(Register reg) {
+  return 1 << reg;
+}
+
+struct FunctionSignature {
+  RegisterMask args;
+  RegisterMask rets;
+
+  bool operator==(const FunctionSignature &other) const {
+    return args == other.args && rets == other.rets;
+  }
+
+  bool operator!=(const FunctionSignature &other) const {
+    return !(*this == other);
+  }
+};
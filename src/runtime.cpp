@@ -0,0 +1,510 @@
+#include "runtime.hpp"
+
+#include <cstring>
+
+#include <algorithm>
+
+#include <string>
+using std::string;
+
+#include <vector>
+using std::vector;
+
+#include "interpreter.hpp"
+#include "nes_machine_spec.hpp"
+
+const unsigned CYCLES_PER_FRAME = 29781;
+const unsigned VBLANK_START_CYCLE = 27393;
+const unsigned STATUS_POLL_CYCLES = 7;
+
+const word STATUS_VBLANK = 0x80;
+const word CTRL_NMI = 0x80;
+
+const addr PPU_REGISTERS_START = 0x2000;
+const addr PPU_MIRROR_MASK = 0x2007;
+const addr APU_REGISTERS_START = 0x4000;
+const addr CONTROLLER_PORT = 0x4016;
+const addr PRG_RAM_START = 0x6000;
+
+Ppu::Ppu() :
+  ctrl(0),
+  status(0),
+  latch(false),
+  scrollX(0),
+  scrollY(0),
+  vramAddr(0),
+  cycle(0),
+  frame(0),
+  nmi(false)
+{
+  memset(vram, 0, sizeof(vram));
+}
+
+word Ppu::readStatus() {
+  word result = status;
+  status &= ~STATUS_VBLANK;
+  latch = false;
+  return result;
+}
+
+void Ppu::writeCtrl(word value) {
+  if ((value & CTRL_NMI) && !(ctrl & CTRL_NMI) && (status & STATUS_VBLANK)) {
+    nmi = true;
+  }
+  ctrl = value;
+}
+
+void Ppu::writeScroll(word value) {
+  if (latch) {
+    scrollY = value;
+  } else {
+    scrollX = value;
+  }
+  latch = !latch;
+}
+
+void Ppu::writeAddr(word value) {
+  if (latch) {
+    vramAddr = (vramAddr & 0xFF00) | value;
+  } else {
+    vramAddr = (vramAddr & 0x00FF) | ((value & 0x3F) << 8);
+  }
+  latch = !latch;
+}
+
+void Ppu::writeData(word value) {
+  vram[vramAddr & 0x3FFF] = value;
+  vramAddr += (ctrl & 0x04) ? 32 : 1;
+}
+
+void Ppu::advance(unsigned cycles) {
+  unsigned previous = cycle;
+  cycle += cycles;
+
+  if (previous < VBLANK_START_CYCLE && cycle >= VBLANK_START_CYCLE) {
+    status |= STATUS_VBLANK;
+    if (ctrl & CTRL_NMI) {
+      nmi = true;
+    }
+  }
+
+  if (cycle >= CYCLES_PER_FRAME) {
+    cycle -= CYCLES_PER_FRAME;
+    status &= ~STATUS_VBLANK;
+    frame++;
+  }
+}
+
+uint64_t Ppu::getFrame() const {
+  return frame;
+}
+
+unsigned Ppu::getCyclesToNextEvent() const {
+  if (cycle < VBLANK_START_CYCLE) {
+    return VBLANK_START_CYCLE - cycle;
+  }
+  return CYCLES_PER_FRAME - cycle;
+}
+
+bool Ppu::hasPendingNmi() const {
+  return nmi;
+}
+
+bool Ppu::takeNmi() {
+  bool result = nmi;
+  nmi = false;
+  return result;
+}
+
+DispatchTable::DispatchTable() {
+  memset(entries, 0, sizeof(entries));
+}
+
+EntryPoint DispatchTable::lookup(addr start) const {
+  return entries[start];
+}
+
+void DispatchTable::insert(addr start, EntryPoint entry) {
+  entries[start] = entry;
+}
+
+NesRuntime *currentRuntime = NULL;
+
+NesRuntime::NesRuntime(const NesMachineSpec &machine) :
+  machine(machine),
+  interpreter(new Interpreter(*this))
+{
+  memset(state.ram, 0, sizeof(state.ram));
+  memset(&controller, 0, sizeof(controller));
+  if (machine.hasPrgRam()) {
+    prgRam.reset(new word[PRG_RAM_SIZE]());
+  }
+  state.prgRam = prgRam.get();
+  state.runtime = this;
+  state.pendingEntry = NULL;
+  grantCycles();
+}
+
+NesRuntime::~NesRuntime() {}
+
+word NesRuntime::read(addr address) {
+  if (address < PPU_REGISTERS_START) {
+    return state.ram[address & (RAM_SIZE - 1)];
+  } else if (address >= PRG_ROM_START) {
+    return machine.readWord(address);
+  } else if (address >= PRG_RAM_START) {
+    return prgRam ? prgRam[address & (PRG_RAM_SIZE - 1)] : 0;
+  } else if (address < APU_REGISTERS_START) {
+    address &= PPU_MIRROR_MASK;
+  }
+
+  switch (address) {
+    case 0x2002:
+      return readPPUStatus();
+    case CONTROLLER_PORT: {
+      if (controller.strobe) {
+        return controller.buttons & 1;
+      }
+      word bit = controller.shift & 1;
+      controller.shift = (controller.shift >> 1) | 0x80;
+      return bit;
+    }
+    default:
+      return 0;
+  }
+}
+
+word NesRuntime::readPPUStatus() {
+  advance(STATUS_POLL_CYCLES);
+  return ppu.readStatus();
+}
+
+void NesRuntime::writePPUCtrl(word value) {
+  ppu.writeCtrl(value);
+  advance(0);
+}
+
+// Time advances when the game polls the PPU and whenever recompiled or
+// interpreted code runs out of its cycle budget.
+void NesRuntime::advance(unsigned cycles) {
+  uint64_t frame = ppu.getFrame();
+  ppu.advance(cycles);
+  if (ppu.getFrame() != frame && frameHandler) {
+    frameHandler();
+  }
+  if (ppu.hasPendingNmi()) {
+    requestPoll();
+  }
+}
+
+// Zeroing the budget makes the next poll point call in, while keeping
+// the cycles already spent out of it accounted for.
+void NesRuntime::requestPoll() {
+  budgetGrant -= state.cycleBudget;
+  state.cycleBudget = 0;
+}
+
+void NesRuntime::grantCycles() {
+  budgetGrant = std::max(ppu.getCyclesToNextEvent(), 1u);
+  state.cycleBudget = budgetGrant;
+}
+
+// Called from poll points once the budget is used up. Interrupt handlers
+// run like a call, natively when they have been compiled, and return to
+// the code that was interrupted.
+void NesRuntime::poll() {
+  int32_t elapsed = budgetGrant - state.cycleBudget;
+  budgetGrant = state.cycleBudget = 0;
+  advance(std::max(elapsed, 0));
+  grantCycles();
+
+  if (ppu.takeNmi()) {
+    RegisterState regs = {0, 0, 0, 0, 0, 0, 0};
+    enter(interpreter->dispatch(machine.getNMIAddr(), regs), regs);
+  }
+}
+
+// Called from idle loops, which cannot make progress until the PPU reaches
+// its next event, so the time until then passes in one step. Budget spent
+// but not yet applied to the PPU counts towards it; if it already reaches
+// the event, the loop just gets to look again.
+void NesRuntime::waitForEvent() {
+  int32_t elapsed = budgetGrant - state.cycleBudget;
+  int32_t untilEvent = ppu.getCyclesToNextEvent();
+  if (!ppu.hasPendingNmi() && elapsed < untilEvent) {
+    state.cycleBudget -= untilEvent - elapsed;
+  }
+  poll();
+}
+
+void NesRuntime::setButtons(word buttons) {
+  controller.buttons = buttons;
+}
+
+void NesRuntime::setFrameHandler(std::function<void()> handler) {
+  frameHandler = handler;
+}
+
+// Everything the emulated machine can change, for save states. The PPU and
+// controller are plain data, so they are saved byte for byte.
+void NesRuntime::getStateRegions(vector<StateRegion> &regions) {
+  regions.push_back({state.ram, RAM_SIZE, 0});
+  if (prgRam) {
+    regions.push_back({prgRam.get(), PRG_RAM_SIZE, 0});
+  }
+  regions.push_back({(word *)&ppu, sizeof(ppu), 0});
+  regions.push_back({(word *)&controller, sizeof(controller), 0});
+  regions.push_back({(word *)&state.cycleBudget, sizeof(state.cycleBudget), 0});
+  regions.push_back({(word *)&budgetGrant, sizeof(budgetGrant), 0});
+  interpreter->getStateRegions(regions);
+}
+
+void NesRuntime::write(addr address, word value) {
+  if (address < PPU_REGISTERS_START) {
+    state.ram[address & (RAM_SIZE - 1)] = value;
+    return;
+  } else if (address >= PRG_ROM_START) {
+    return;
+  } else if (address >= PRG_RAM_START) {
+    if (prgRam) {
+      prgRam[address & (PRG_RAM_SIZE - 1)] = value;
+    }
+    return;
+  } else if (address < APU_REGISTERS_START) {
+    address &= PPU_MIRROR_MASK;
+  }
+
+  switch (address) {
+    case 0x2000:
+      writePPUCtrl(value);
+      break;
+    case 0x2005:
+      ppu.writeScroll(value);
+      break;
+    case 0x2006:
+      ppu.writeAddr(value);
+      break;
+    case 0x2007:
+      ppu.writeData(value);
+      break;
+    case CONTROLLER_PORT:
+      controller.strobe = value & 1;
+      if (controller.strobe) {
+        controller.shift = controller.buttons;
+      }
+      break;
+  }
+}
+
+word *NesRuntime::getRam() {
+  return state.ram;
+}
+
+word *NesRuntime::getPrgRam() {
+  return prgRam.get();
+}
+
+const word *NesRuntime::getPrgRom() const {
+  return machine.getPrgRom();
+}
+
+MachineState *NesRuntime::getState() {
+  return &state;
+}
+
+Ppu &NesRuntime::getPpu() {
+  return ppu;
+}
+
+// Only the runtime that drives the JIT fills a table; batch instances
+// resolve through it, so they never pay for one of their own.
+DispatchTable &NesRuntime::getDispatchTable() {
+  if (!dispatchTable) {
+    dispatchTable.reset(new DispatchTable());
+  }
+  return *dispatchTable;
+}
+
+Interpreter &NesRuntime::getInterpreter() {
+  return *interpreter;
+}
+
+// Native indirect jumps return with their target pending rather than
+// calling it, so keep running entries until none is left.
+void NesRuntime::enter(EntryPoint entry, RegisterState &regs) {
+  while (entry) {
+    state.pendingEntry = NULL;
+    entry(&state, &regs);
+    entry = state.pendingEntry;
+  }
+}
+
+void NesRuntime::makeCurrent() {
+  currentRuntime = this;
+}
+
+NesRuntime &NesRuntime::current() {
+  return *currentRuntime;
+}
+
+extern "C" {
+  word runtimeReadPPUStatus() {
+    return NesRuntime::current().readPPUStatus();
+  }
+
+  void runtimeWritePPUCtrl(word value) {
+    NesRuntime::current().writePPUCtrl(value);
+  }
+
+  void runtimeWritePPUScroll(word value) {
+    NesRuntime::current().getPpu().writeScroll(value);
+  }
+
+  void runtimeWritePPUAddr(word value) {
+    NesRuntime::current().getPpu().writeAddr(value);
+  }
+
+  void runtimeWritePPUData(word value) {
+    NesRuntime::current().getPpu().writeData(value);
+  }
+
+  word runtimeReadMemory(addr address) {
+    return NesRuntime::current().read(address);
+  }
+
+  void runtimeWriteMemory(addr address, word value) {
+    NesRuntime::current().write(address, value);
+  }
+
+  void runtimeInterpret(addr pc, RegisterState *regs) {
+    NesRuntime::current().getInterpreter().run(pc, *regs);
+  }
+
+  EntryPoint runtimeDispatch(addr target, RegisterState *regs) {
+    return NesRuntime::current().getInterpreter().dispatch(target, *regs);
+  }
+
+  void runtimeTrampoline(RegisterState *regs) {
+    NesRuntime &runtime = NesRuntime::current();
+    runtime.enter(runtime.getState()->pendingEntry, *regs);
+  }
+
+  void runtimePoll() {
+    NesRuntime::current().poll();
+  }
+
+  void runtimeWaitForEvent() {
+    NesRuntime::current().waitForEvent();
+  }
+
+  word instanceReadPPUStatus(MachineState *state) {
+    return state->runtime->readPPUStatus();
+  }
+
+  void instanceWritePPUCtrl(MachineState *state, word value) {
+    state->runtime->writePPUCtrl(value);
+  }
+
+  void instanceWritePPUScroll(MachineState *state, word value) {
+    state->runtime->getPpu().writeScroll(value);
+  }
+
+  void instanceWritePPUAddr(MachineState *state, word value) {
+    state->runtime->getPpu().writeAddr(value);
+  }
+
+  void instanceWritePPUData(MachineState *state, word value) {
+    state->runtime->getPpu().writeData(value);
+  }
+
+  word instanceReadMemory(MachineState *state, addr address) {
+    return state->runtime->read(address);
+  }
+
+  void instanceWriteMemory(MachineState *state, addr address, word value) {
+    state->runtime->write(address, value);
+  }
+
+  void instanceInterpret(MachineState *state, addr pc, RegisterState *regs) {
+    state->runtime->getInterpreter().run(pc, *regs);
+  }
+
+  EntryPoint instanceDispatch(MachineState *state, addr target, RegisterState *regs) {
+    return state->runtime->getInterpreter().dispatch(target, *regs);
+  }
+
+  void instanceTrampoline(MachineState *state, RegisterState *regs) {
+    state->runtime->enter(state->pendingEntry, *regs);
+  }
+
+  void instancePoll(MachineState *state) {
+    state->runtime->poll();
+  }
+
+  void instanceWaitForEvent(MachineState *state) {
+    state->runtime->waitForEvent();
+  }
+}
+
+void *lookupRuntimeSymbol(const string &name, NesRuntime &runtime) {
+  if (name == "ram") {
+    return runtime.getRam();
+  } else if (name == "prg_ram") {
+    return runtime.getPrgRam();
+  } else if (name == "prg_rom") {
+    return (void *)runtime.getPrgRom();
+  } else if (name == "cycle_budget") {
+    return &runtime.getState()->cycleBudget;
+  } else if (name == "readPPUStatus") {
+    return (void *)runtimeReadPPUStatus;
+  } else if (name == "writePPUCtrl") {
+    return (void *)runtimeWritePPUCtrl;
+  } else if (name == "writePPUScroll") {
+    return (void *)runtimeWritePPUScroll;
+  } else if (name == "writePPUAddr") {
+    return (void *)runtimeWritePPUAddr;
+  } else if (name == "writePPUData") {
+    return (void *)runtimeWritePPUData;
+  } else if (name == "readMemory") {
+    return (void *)runtimeReadMemory;
+  } else if (name == "writeMemory") {
+    return (void *)runtimeWriteMemory;
+  } else if (name == "interpret") {
+    return (void *)runtimeInterpret;
+  } else if (name == "dispatch") {
+    return (void *)runtimeDispatch;
+  } else if (name == "trampoline") {
+    return (void *)runtimeTrampoline;
+  } else if (name == "pending_entry") {
+    return &runtime.getState()->pendingEntry;
+  } else if (name == "poll") {
+    return (void *)runtimePoll;
+  } else if (name == "waitForEvent") {
+    return (void *)runtimeWaitForEvent;
+  } else if (name == "instanceReadPPUStatus") {
+    return (void *)instanceReadPPUStatus;
+  } else if (name == "instanceWritePPUCtrl") {
+    return (void *)instanceWritePPUCtrl;
+  } else if (name == "instanceWritePPUScroll") {
+    return (void *)instanceWritePPUScroll;
+  } else if (name == "instanceWritePPUAddr") {
+    return (void *)instanceWritePPUAddr;
+  } else if (name == "instanceWritePPUData") {
+    return (void *)instanceWritePPUData;
+  } else if (name == "instanceReadMemory") {
+    return (void *)instanceReadMemory;
+  } else if (name == "instanceWriteMemory") {
+    return (void *)instanceWriteMemory;
+  } else if (name == "instanceInterpret") {
+    return (void *)instanceInterpret;
+  } else if (name == "instanceDispatch") {
+    return (void *)instanceDispatch;
+  } else if (name == "instanceTrampoline") {
+    return (void *)instanceTrampoline;
+  } else if (name == "instancePoll") {
+    return (void *)instancePoll;
+  } else if (name == "instanceWaitForEvent") {
+    return (void *)instanceWaitForEvent;
+  }
+  return NULL;
+}
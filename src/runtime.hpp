@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "memory.hpp"
+#include "savestate.hpp"
+
+struct RegisterState {
+  word a;
+  word x;
+  word y;
+  word n;
+  word v;
+  word z;
+  word c;
+};
+
+class NesRuntime;
+struct MachineState;
+
+typedef void (*EntryPoint)(MachineState *, RegisterState *);
+
+// Emulated memory as seen by instanced code, which receives a pointer to
+// it instead of referencing the ram and prg_ram globals. Native code also
+// leaves the target of an indirect jump here for its caller to run.
+struct MachineState {
+  word ram[RAM_SIZE];
+  word *prgRam;
+  NesRuntime *runtime;
+  EntryPoint pendingEntry;
+  int32_t cycleBudget;
+};
+
+class Ppu {
+  public:
+    Ppu();
+
+    word readStatus();
+    void writeCtrl(word value);
+    void writeScroll(word value);
+    void writeAddr(word value);
+    void writeData(word value);
+
+    void advance(unsigned cycles);
+    uint64_t getFrame() const;
+    unsigned getCyclesToNextEvent() const;
+    bool hasPendingNmi() const;
+    bool takeNmi();
+
+  private:
+    word ctrl;
+    word status;
+    bool latch;
+    word scrollX;
+    word scrollY;
+    addr vramAddr;
+    word vram[0x4000];
+    unsigned cycle;
+    uint64_t frame;
+    bool nmi;
+};
+
+class DispatchTable {
+  public:
+    DispatchTable();
+
+    EntryPoint lookup(addr start) const;
+    void insert(addr start, EntryPoint entry);
+
+  private:
+    EntryPoint entries[ADDR_MAX + 1];
+};
+
+struct Controller {
+  word buttons;
+  word shift;
+  word strobe;
+};
+
+class Interpreter;
+class NesMachineSpec;
+
+class NesRuntime {
+  public:
+    NesRuntime(const NesMachineSpec &machine);
+    ~NesRuntime();
+
+    word read(addr address);
+    void write(addr address, word value);
+    word readPPUStatus();
+    void writePPUCtrl(word value);
+    void poll();
+    void waitForEvent();
+
+    void setButtons(word buttons);
+    void setFrameHandler(std::function<void()> handler);
+    void getStateRegions(std::vector<StateRegion> &regions);
+
+    word *getRam();
+    word *getPrgRam();
+    const word *getPrgRom() const;
+    MachineState *getState();
+    Ppu &getPpu();
+    DispatchTable &getDispatchTable();
+    Interpreter &getInterpreter();
+
+    void enter(EntryPoint entry, RegisterState &regs);
+
+    void makeCurrent();
+    static NesRuntime &current();
+
+  private:
+    void advance(unsigned cycles);
+    void requestPoll();
+    void grantCycles();
+
+    const NesMachineSpec &machine;
+    MachineState state;
+    int32_t budgetGrant;
+    std::unique_ptr<word[]> prgRam;
+    Ppu ppu;
+    Controller controller;
+    std::function<void()> frameHandler;
+    std::unique_ptr<DispatchTable> dispatchTable;
+    std::unique_ptr<Interpreter> interpreter;
+};
+
+void *lookupRuntimeSymbol(const std::string &name, NesRuntime &runtime);
@@ -0,0 +1,208 @@
+#include "savestate.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+using std::min;
+
+#include <vector>
+using std::vector;
+
+const char STATE_DELTA_MAGIC[4] = {'N', 'S', 'D', '1'};
+
+size_t getPageStart(size_t offset) {
+  return offset & ~(STATE_PAGE_SIZE - 1);
+}
+
+size_t getPageLength(const StateRegion &region, size_t offset) {
+  return min(STATE_PAGE_SIZE, region.size - offset);
+}
+
+StateHistory::StateHistory(size_t capacity) :
+  capacity(std::max<size_t>(capacity, 1))
+{}
+
+// The pages compared against the baseline only ever grow towards the
+// start of a region. A page that was dead at every earlier snapshot can
+// join without an undo record, since none of them care about its contents.
+void StateHistory::capture(const vector<StateRegion> &regions) {
+  Delta delta;
+  for (unsigned i = 0; i < regions.size(); i++) {
+    const StateRegion &region = regions[i];
+    size_t start = getPageStart(region.liveStart);
+
+    if (i == baseline.size()) {
+      baseline.push_back(std::unique_ptr<word[]>(new word[region.size]));
+      baselineStart.push_back(region.size);
+    }
+
+    word *base = baseline[i].get();
+    if (start < baselineStart[i]) {
+      memcpy(base + start, region.data + start, baselineStart[i] - start);
+      baselineStart[i] = start;
+    }
+
+    for (size_t offset = baselineStart[i]; offset < region.size; offset += STATE_PAGE_SIZE) {
+      size_t length = getPageLength(region, offset);
+      if (memcmp(base + offset, region.data + offset, length)) {
+        delta.pages.push_back({i, offset});
+        delta.contents.insert(delta.contents.end(), base + offset, base + offset + length);
+        memcpy(base + offset, region.data + offset, length);
+      }
+    }
+  }
+
+  deltas.push_back(std::move(delta));
+  if (deltas.size() > capacity) {
+    deltas.pop_front();
+  }
+}
+
+void StateHistory::revertToBaseline(const vector<StateRegion> &regions) {
+  for (unsigned i = 0; i < regions.size(); i++) {
+    const StateRegion &region = regions[i];
+    const word *base = baseline[i].get();
+    for (size_t offset = baselineStart[i]; offset < region.size; offset += STATE_PAGE_SIZE) {
+      size_t length = getPageLength(region, offset);
+      if (memcmp(base + offset, region.data + offset, length)) {
+        memcpy(region.data + offset, base + offset, length);
+      }
+    }
+  }
+}
+
+// Rolls back to the snapshot taken age captures ago, discarding the ones
+// after it. An age of zero restores the most recent snapshot.
+bool StateHistory::restore(size_t age, const vector<StateRegion> &regions) {
+  if (age >= deltas.size() || regions.size() != baseline.size()) {
+    return false;
+  }
+
+  revertToBaseline(regions);
+  for (size_t i = 0; i < age; i++) {
+    const Delta &delta = deltas.back();
+    const word *contents = delta.contents.data();
+    for (auto &page : delta.pages) {
+      const StateRegion &region = regions[page.region];
+      size_t length = getPageLength(region, page.offset);
+      memcpy(region.data + page.offset, contents, length);
+      memcpy(baseline[page.region].get() + page.offset, contents, length);
+      contents += length;
+    }
+    deltas.pop_back();
+  }
+  return true;
+}
+
+size_t StateHistory::size() const {
+  return deltas.size();
+}
+
+vector<word> flattenState(const vector<StateRegion> &regions) {
+  vector<word> state;
+  for (auto &region : regions) {
+    state.insert(state.end(), region.data + region.liveStart, region.data + region.size);
+  }
+  return state;
+}
+
+bool unflattenState(const vector<word> &state, const vector<StateRegion> &regions) {
+  size_t total = 0;
+  for (auto &region : regions) {
+    total += region.size - region.liveStart;
+  }
+  if (total != state.size()) {
+    return false;
+  }
+
+  const word *next = state.data();
+  for (auto &region : regions) {
+    memcpy(region.data + region.liveStart, next, region.size - region.liveStart);
+    next += region.size - region.liveStart;
+  }
+  return true;
+}
+
+void writeVarint(uint64_t value, std::ostream &out) {
+  while (value >= 0x80) {
+    out.put((char)((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  out.put((char)value);
+}
+
+bool readVarint(std::istream &in, uint64_t &value) {
+  value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    int byte = in.get();
+    if (byte == EOF) {
+      return false;
+    }
+    value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+word getReferenceByte(const vector<word> &reference, size_t index) {
+  return index < reference.size() ? reference[index] : 0;
+}
+
+// States are stored as the XOR against a reference, usually the previous
+// state in a sequence or nothing at all, as alternating runs of unchanged
+// bytes and literal differences.
+void writeStateDelta(const vector<word> &state, const vector<word> &reference, std::ostream &out) {
+  out.write(STATE_DELTA_MAGIC, sizeof(STATE_DELTA_MAGIC));
+  writeVarint(state.size(), out);
+
+  size_t i = 0;
+  while (i < state.size()) {
+    size_t same = i;
+    while (same < state.size() && state[same] == getReferenceByte(reference, same)) {
+      same++;
+    }
+    size_t changed = same;
+    while (changed < state.size() && state[changed] != getReferenceByte(reference, changed)) {
+      changed++;
+    }
+
+    writeVarint(same - i, out);
+    writeVarint(changed - same, out);
+    for (size_t j = same; j < changed; j++) {
+      out.put((char)(state[j] ^ getReferenceByte(reference, j)));
+    }
+    i = changed;
+  }
+}
+
+bool readStateDelta(std::istream &in, const vector<word> &reference, vector<word> &state) {
+  char magic[sizeof(STATE_DELTA_MAGIC)];
+  uint64_t size;
+  if (!in.read(magic, sizeof(magic)) || memcmp(magic, STATE_DELTA_MAGIC, sizeof(magic)) || !readVarint(in, size)) {
+    return false;
+  }
+
+  state.resize(size);
+  size_t i = 0;
+  while (i < size) {
+    uint64_t same, changed;
+    if (!readVarint(in, same) || !readVarint(in, changed) || same + changed > size - i) {
+      return false;
+    }
+
+    for (size_t end = i + same; i < end; i++) {
+      state[i] = getReferenceByte(reference, i);
+    }
+    for (size_t end = i + changed; i < end; i++) {
+      int byte = in.get();
+      if (byte == EOF) {
+        return false;
+      }
+      state[i] = byte ^ getReferenceByte(reference, i);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include "memory.hpp"
+
+const size_t STATE_PAGE_SIZE = 0x100;
+
+// A block of memory that makes up part of an instance's state. Bytes
+// before liveStart are dead, like the unused part of a stack, and are
+// neither compared nor saved.
+struct StateRegion {
+  word *data;
+  size_t size;
+  size_t liveStart;
+};
+
+// Ring of snapshots kept as an undo log: each entry holds the previous
+// contents of the pages that changed since the snapshot before it, so
+// rolling back only copies pages that actually changed.
+class StateHistory {
+  public:
+    StateHistory(size_t capacity);
+
+    void capture(const std::vector<StateRegion> &regions);
+    bool restore(size_t age, const std::vector<StateRegion> &regions);
+    size_t size() const;
+
+  private:
+    struct PageRecord {
+      unsigned region;
+      size_t offset;
+    };
+
+    struct Delta {
+      std::vector<PageRecord> pages;
+      std::vector<word> contents;
+    };
+
+    void revertToBaseline(const std::vector<StateRegion> &regions);
+
+    size_t capacity;
+    std::deque<Delta> deltas;
+    std::vector<std::unique_ptr<word[]>> baseline;
+    std::vector<size_t> baselineStart;
+};
+
+std::vector<word> flattenState(const std::vector<StateRegion> &regions);
+bool unflattenState(const std::vector<word> &state, const std::vector<StateRegion> &regions);
+
+void writeStateDelta(const std::vector<word> &state, const std::vector<word> &reference, std::ostream &out);
+bool readStateDelta(std::istream &in, const std::vector<word> &reference, std::vector<word> &state);
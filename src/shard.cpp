@@ -0,0 +1,219 @@
+#include "shard.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+#include <memory>
+using std::unique_ptr;
+
+#include <string>
+using std::string;
+
+#include <thread>
+using std::thread;
+
+#include <vector>
+using std::vector;
+
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+using llvm::ErrorOr;
+using llvm::Function;
+using llvm::GlobalValue;
+using llvm::LLVMContext;
+using llvm::Linker;
+using llvm::MemoryBufferRef;
+using llvm::Module;
+using llvm::raw_string_ostream;
+
+#include <iostream>
+
+#include "addr_set.hpp"
+#include "cache.hpp"
+#include "codegen.hpp"
+#include "flow.hpp"
+#include "machine_spec.hpp"
+#include "program.hpp"
+
+vector<Shard> partitionFunctions(const Program &program, unsigned shardCount) {
+  vector<std::pair<unsigned, addr> > bySize;
+  for (auto funcStart : program.getFunctions()) {
+    bySize.push_back(std::make_pair(program.getFunction(funcStart).instructions.size(), funcStart));
+  }
+  std::sort(bySize.begin(), bySize.end(), [](const std::pair<unsigned, addr> &a, const std::pair<unsigned, addr> &b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+  });
+
+  vector<Shard> shards(shardCount);
+  vector<unsigned> load(shardCount, 0);
+  for (auto &entry : bySize) {
+    unsigned lightest = std::min_element(load.begin(), load.end()) - load.begin();
+    shards[lightest].push_back(entry.second);
+    load[lightest] += entry.first;
+  }
+
+  return shards;
+}
+
+void writeShard(const Shard &shard, const AddrSet &entries, bool linkable, const Program &program, ModuleGenerator &modgen) {
+  program.getMachine().writeLLVMHeader(modgen);
+
+  AddrSet declared;
+  for (auto funcStart : shard) {
+    declared.insert(funcStart);
+    declared.insert(program.getFunction(funcStart).callees);
+  }
+
+  for (auto funcStart : declared) {
+    declareFunction(funcStart, program.getFunction(funcStart).signature, linkable || entries.count(funcStart), modgen);
+  }
+
+  for (auto funcStart : shard) {
+    writeFunction(funcStart, program, modgen);
+  }
+}
+
+string generateShard(const Shard &shard, const AddrSet &entries, const Program &program, OptLevel optLevel, bool instanced) {
+  LLVMContext context;
+  ModuleGenerator modgen("shard", program.getMachine(), context, instanced);
+  writeShard(shard, entries, true, program, modgen);
+  prepareModule(modgen.getModule());
+  optimizeFunctions(modgen.getModule(), optLevel);
+
+  string bitcode;
+  raw_string_ostream out(bitcode);
+  llvm::WriteBitcodeToFile(&modgen.getModule(), out);
+  out.flush();
+  return bitcode;
+}
+
+vector<string> generateShards(const vector<Shard> &shards, const AddrSet &entries, const CodegenOptions &options, const Program &program) {
+  vector<string> bitcode(shards.size());
+  std::atomic<unsigned> next(0);
+
+  vector<thread> workers;
+  for (unsigned i = 0; i < options.jobs && i < shards.size(); i++) {
+    workers.push_back(thread([&]() {
+      for (unsigned shard = next++; shard < shards.size(); shard = next++) {
+        bitcode[shard] = generateShard(shards[shard], entries, program, options.optLevel, options.instanced);
+      }
+    }));
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  return bitcode;
+}
+
+vector<string> generateCachedShards(const AddrSet &entries, const CodegenOptions &options, const Program &program) {
+  const CodeCache &cache = *options.cache;
+  vector<string> bitcode;
+  vector<Shard> missing;
+  vector<uint64_t> missingKeys;
+
+  for (auto funcStart : program.getFunctions()) {
+    uint64_t key = hashFunction(funcStart, options.optLevel, options.instanced, program);
+    string cached;
+    if (cache.lookup(key, cached)) {
+      bitcode.push_back(cached);
+    } else {
+      missing.push_back(Shard(1, funcStart));
+      missingKeys.push_back(key);
+    }
+  }
+
+  vector<string> generated = generateShards(missing, entries, options, program);
+  for (unsigned i = 0; i < generated.size(); i++) {
+    cache.store(missingKeys[i], generated[i]);
+    bitcode.push_back(generated[i]);
+  }
+
+  return bitcode;
+}
+
+unique_ptr<Module> linkShards(const vector<string> &bitcode, LLVMContext &context) {
+  unique_ptr<Module> result(new Module("mymod", context));
+  prepareModule(*result);
+
+  for (unsigned i = 0; i < bitcode.size(); i++) {
+    ErrorOr<Module *> shard = llvm::parseBitcodeFile(MemoryBufferRef(bitcode[i], "shard"), context);
+    if (!shard) {
+      std::cerr << "Could not read shard " << i << ": " << shard.getError().message() << std::endl;
+      return NULL;
+    }
+
+    unique_ptr<Module> owner(shard.get());
+    if (Linker::LinkModules(result.get(), owner.get())) {
+      std::cerr << "Could not link shard " << i << std::endl;
+      return NULL;
+    }
+  }
+
+  return result;
+}
+
+unique_ptr<Module> generateModule(const Program &program, const AddrSet &entries, const CodegenOptions &options, LLVMContext &context) {
+  unique_ptr<Module> result;
+
+  if (options.jobs <= 1 && !options.cache) {
+    Shard all(program.getFunctions().begin(), program.getFunctions().end());
+    ModuleGenerator modgen("mymod", program.getMachine(), context, options.instanced);
+    writeShard(all, entries, options.exportFunctions, program, modgen);
+    program.getMachine().writeLLVMDefinitions(modgen.getModule());
+    prepareModule(modgen.getModule());
+    optimizeFunctions(modgen.getModule(), options.optLevel);
+    result = modgen.releaseModule();
+  } else {
+    vector<string> bitcode;
+    if (options.cache) {
+      bitcode = generateCachedShards(entries, options, program);
+    } else {
+      bitcode = generateShards(partitionFunctions(program, options.jobs), entries, options, program);
+    }
+
+    result = linkShards(bitcode, context);
+    if (!result) {
+      return NULL;
+    }
+    program.getMachine().writeLLVMDefinitions(*result);
+
+    for (auto funcStart : program.getFunctions()) {
+      char name[7];
+      sprintf(name, "f_%04X", funcStart);
+      Function *func = result->getFunction(name);
+      if (func && !entries.count(funcStart) && !options.exportFunctions) {
+        func->setLinkage(GlobalValue::PrivateLinkage);
+      }
+    }
+  }
+
+  if (options.exportFunctions) {
+    for (auto funcStart : program.getFunctions()) {
+      writeEntryThunk(funcStart, program.getFunction(funcStart).signature, options.instanced, *result);
+    }
+  } else {
+    for (auto funcStart : entries) {
+      writeEntryThunk(funcStart, program.getFunction(funcStart).signature, options.instanced, *result);
+    }
+  }
+  return result;
+}
+
+unique_ptr<Module> generateIncrementalModule(const Shard &shard, const Program &program, const CodegenOptions &options, LLVMContext &context) {
+  ModuleGenerator modgen("incremental", program.getMachine(), context, options.instanced);
+  writeShard(shard, AddrSet(), true, program, modgen);
+  program.getMachine().writeLLVMDefinitions(modgen.getModule());
+  prepareModule(modgen.getModule());
+  optimizeFunctions(modgen.getModule(), options.optLevel);
+
+  unique_ptr<Module> result = modgen.releaseModule();
+  for (auto funcStart : shard) {
+    writeEntryThunk(funcStart, program.getFunction(funcStart).signature, options.instanced, *result);
+  }
+  return result;
+}
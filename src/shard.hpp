@@ -0,0 +1,30 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+#include "addr_set.hpp"
+#include "backend.hpp"
+#include "memory.hpp"
+
+class CodeCache;
+class Program;
+
+typedef std::vector<addr> Shard;
+
+struct CodegenOptions {
+  unsigned jobs;
+  const CodeCache *cache;
+  OptLevel optLevel;
+  bool exportFunctions;
+  bool instanced;
+};
+
+std::vector<Shard> partitionFunctions(const Program &program, unsigned shardCount);
+std::string generateShard(const Shard &shard, const AddrSet &entries, const Program &program, OptLevel optLevel, bool instanced);
+std::unique_ptr<llvm::Module> generateModule(const Program &program, const AddrSet &entries, const CodegenOptions &options, llvm::LLVMContext &context);
+std::unique_ptr<llvm::Module> generateIncrementalModule(const Shard &shard, const Program &program, const CodegenOptions &options, llvm::LLVMContext &context);
@@ -0,0 +1,129 @@
+#include "value_range.hpp"
+
+#include <algorithm>
+using std::min;
+using std::max;
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Instructions.h"
+using llvm::Value;
+using llvm::ConstantInt;
+using llvm::IntegerType;
+using llvm::Instruction;
+using llvm::BinaryOperator;
+using llvm::ZExtInst;
+using llvm::SelectInst;
+using llvm::PHINode;
+
+// Bounds the search through phis, which may be cyclic.
+const unsigned MAX_RANGE_DEPTH = 8;
+
+uint32_t getMaxValue(Value *value) {
+  unsigned bits = llvm::cast<IntegerType>(value->getType())->getBitWidth();
+  return bits >= 32 ? UINT32_MAX : (1u << bits) - 1;
+}
+
+ValueRange getFullRange(Value *value) {
+  ValueRange result = {0, getMaxValue(value)};
+  return result;
+}
+
+ValueRange getUnion(ValueRange lhs, ValueRange rhs) {
+  ValueRange result = {min(lhs.low, rhs.low), max(lhs.high, rhs.high)};
+  return result;
+}
+
+uint32_t smearRight(uint32_t value) {
+  for (unsigned shift = 1; shift < 32; shift <<= 1) {
+    value |= value >> shift;
+  }
+  return value;
+}
+
+ValueRange getValueRange(Value *value, unsigned depth);
+
+ValueRange getBinaryRange(BinaryOperator *inst, unsigned depth) {
+  ValueRange lhs = getValueRange(inst->getOperand(0), depth);
+  ValueRange rhs = getValueRange(inst->getOperand(1), depth);
+  uint32_t maxValue = getMaxValue(inst);
+  ValueRange result = getFullRange(inst);
+
+  switch (inst->getOpcode()) {
+    case Instruction::Add:
+      if ((uint64_t)lhs.high + rhs.high <= maxValue) {
+        result.low = lhs.low + rhs.low;
+        result.high = lhs.high + rhs.high;
+      }
+      break;
+    case Instruction::Sub:
+      if (lhs.low >= rhs.high) {
+        result.low = lhs.low - rhs.high;
+        result.high = lhs.high - rhs.low;
+      }
+      break;
+    case Instruction::And:
+      result.high = min(lhs.high, rhs.high);
+      break;
+    case Instruction::Or:
+      result.low = max(lhs.low, rhs.low);
+      result.high = smearRight(lhs.high | rhs.high);
+      break;
+    case Instruction::Xor:
+      result.high = smearRight(lhs.high | rhs.high);
+      break;
+    case Instruction::Shl:
+      if (rhs.low == rhs.high && rhs.high < 32 && ((uint64_t)lhs.high << rhs.high) <= maxValue) {
+        result.low = lhs.low << rhs.high;
+        result.high = lhs.high << rhs.high;
+      }
+      break;
+    case Instruction::LShr:
+      if (rhs.low == rhs.high && rhs.high < 32) {
+        result.low = lhs.low >> rhs.high;
+        result.high = lhs.high >> rhs.high;
+      }
+      break;
+    default:
+      break;
+  }
+  return result;
+}
+
+ValueRange getValueRange(Value *value, unsigned depth) {
+  if (ConstantInt *constant = llvm::dyn_cast<ConstantInt>(value)) {
+    uint32_t n = constant->getZExtValue();
+    ValueRange result = {n, n};
+    return result;
+  }
+
+  if (depth == 0) {
+    return getFullRange(value);
+  }
+  depth--;
+
+  if (BinaryOperator *inst = llvm::dyn_cast<BinaryOperator>(value)) {
+    return getBinaryRange(inst, depth);
+  } else if (ZExtInst *inst = llvm::dyn_cast<ZExtInst>(value)) {
+    return getValueRange(inst->getOperand(0), depth);
+  } else if (SelectInst *inst = llvm::dyn_cast<SelectInst>(value)) {
+    return getUnion(getValueRange(inst->getTrueValue(), depth), getValueRange(inst->getFalseValue(), depth));
+  } else if (PHINode *phi = llvm::dyn_cast<PHINode>(value)) {
+    if (phi->getNumIncomingValues() == 0) {
+      return getFullRange(value);
+    }
+    ValueRange result = getValueRange(phi->getIncomingValue(0), depth);
+    for (unsigned i = 1; i < phi->getNumIncomingValues(); i++) {
+      result = getUnion(result, getValueRange(phi->getIncomingValue(i), depth));
+    }
+    return result;
+  }
+
+  return getFullRange(value);
+}
+
+// A conservative unsigned interval for an integer value, derived from the
+// instructions that compute it.
+ValueRange getValueRange(Value *value) {
+  return getValueRange(value, MAX_RANGE_DEPTH);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+namespace llvm {
+  class Value;
+}
+
+struct ValueRange {
+  uint32_t low;
+  uint32_t high;
+};
+
+ValueRange getValueRange(llvm::Value *value);